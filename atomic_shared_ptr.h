@@ -0,0 +1,505 @@
+#ifndef ATOMIC_SHARED_PTR_H_
+#define ATOMIC_SHARED_PTR_H_
+
+#include <atomic>
+#include <cstdint>
+#include <stdexcept>
+#include "futex.h"
+#include "shared_ptr.h"
+#include "weak_ptr.h"
+
+// One atomic word holding a control block pointer in the low 48 bits
+// and a count of loads in the high 16 (split reference counting).
+// The word owns `batch` references of its block, taken when it is stored.
+// A load claims one of them by incrementing the local count, so it never
+// touches the block before the block is known to be alive. Whoever swaps
+// the word out drops the references no load has claimed. Loads give
+// references back in bulk (refill) long before the local count can overflow.
+// Weak selects whether the references are strong or weak ones
+template<class Policy, bool Weak>
+struct split_ref_word
+{
+  static_assert(Policy::is_thread_safe, "the counting policy must be thread-safe");
+  static_assert(sizeof(void *) == 8, "control block pointers must fit in 48 bits");
+
+  using block = control_block<Policy>;
+
+  static constexpr size_t batch = size_t(1) << 15;
+
+  split_ref_word() noexcept = default;
+  // Takes over cblock with batch references, see prepare
+  explicit split_ref_word(block *cblock) noexcept : word(pack(cblock)) {}
+
+  split_ref_word(const split_ref_word &) = delete;
+  split_ref_word & operator=(const split_ref_word &) = delete;
+
+  ~split_ref_word();
+
+  // Turns the caller's one reference into batch ones
+  static void prepare(block *cblock) noexcept
+  {
+    if (cblock != nullptr)
+    {
+      add(cblock, batch - 1);
+    }
+  }
+
+  // Drops the batch references of a prepared block that was not stored
+  static void unprepare(block *cblock) noexcept
+  {
+    if (cblock != nullptr)
+    {
+      del(cblock, batch);
+    }
+  }
+
+  // Returns the stored block with one reference for the caller
+  block * load() noexcept;
+
+  // Stores a prepared block and returns the old one
+  // with one reference for the caller
+  block * exchange(block *desired) noexcept;
+
+  // Stores a prepared block if expected is stored. The word's references
+  // of expected are dropped on success, nothing is changed on failure
+  bool compare_exchange(block *expected, block *desired) noexcept;
+
+  bool is_lock_free() const noexcept
+  {
+    return word.is_lock_free();
+  }
+
+  // The stored block, without a reference. Only good for comparisons
+  block * peek() const noexcept
+  {
+    return unpack(word.load(std::memory_order_acquire));
+  }
+
+  static void add(block *cblock, size_t n) noexcept
+  {
+    if constexpr (Weak)
+      cblock->add_weak(n);
+    else
+      cblock->add_ref(n);
+  }
+
+  static void del(block *cblock, size_t n) noexcept
+  {
+    if constexpr (Weak)
+      cblock->del_weak(n);
+    else
+      cblock->del_ref(n);
+  }
+
+private:
+  static constexpr int local_shift = 48;
+  static constexpr uint64_t local_one = uint64_t(1) << local_shift;
+  static constexpr uint64_t pointer_mask = local_one - 1;
+  // The load that brings the local count here gives half a batch back
+  static constexpr size_t refill_at = batch / 2;
+
+  std::atomic<uint64_t> word{0};
+
+  static uint64_t pack(block *cblock) noexcept
+  {
+    return reinterpret_cast<uintptr_t>(cblock);
+  }
+
+  static block * unpack(uint64_t w) noexcept
+  {
+    return reinterpret_cast<block *>(static_cast<uintptr_t>(w & pointer_mask));
+  }
+
+  static size_t local(uint64_t w) noexcept
+  {
+    return w >> local_shift;
+  }
+
+  void refill(block *cblock, size_t n) noexcept;
+};
+
+template<class Policy, bool Weak>
+split_ref_word<Policy, Weak>::~split_ref_word()
+{
+  uint64_t w = word.load(std::memory_order_relaxed);
+  if (block *cblock = unpack(w))
+  {
+    del(cblock, batch - local(w));
+  }
+}
+
+template<class Policy, bool Weak>
+typename split_ref_word<Policy, Weak>::block * split_ref_word<Policy, Weak>::load() noexcept
+{
+  // Empty words are not counted on, so their local count stays small
+  if (unpack(word.load(std::memory_order_acquire)) == nullptr)
+  {
+    return nullptr;
+  }
+  uint64_t w = word.fetch_add(local_one, std::memory_order_acquire);
+  block *cblock = unpack(w);
+  if (cblock == nullptr)
+  {
+    return nullptr;
+  }
+  size_t count = local(w) + 1;
+  if (count >= refill_at)
+  {
+    // While the refill is pending, later loads give their own claims back,
+    // so the count is bounded by the number of concurrent loads
+    refill(cblock, count == refill_at ? refill_at : 1);
+  }
+  return cblock;
+}
+
+// Adds n references to the block and takes n claims off the word.
+// The caller's claim keeps the block alive throughout. If the word was
+// swapped out meanwhile, the swapper already settled the claims
+template<class Policy, bool Weak>
+void split_ref_word<Policy, Weak>::refill(block *cblock, size_t n) noexcept
+{
+  add(cblock, n);
+  uint64_t cur = word.load(std::memory_order_relaxed);
+  while (unpack(cur) == cblock && local(cur) >= n)
+  {
+    if (word.compare_exchange_weak(cur, cur - n * local_one, std::memory_order_relaxed))
+    {
+      return;
+    }
+  }
+  del(cblock, n);
+}
+
+template<class Policy, bool Weak>
+typename split_ref_word<Policy, Weak>::block * split_ref_word<Policy, Weak>::exchange(block *desired) noexcept
+{
+  uint64_t old = word.exchange(pack(desired), std::memory_order_acq_rel);
+  block *cblock = unpack(old);
+  if (cblock != nullptr && batch - local(old) > 1)
+  {
+    del(cblock, batch - local(old) - 1);
+  }
+  return cblock;
+}
+
+template<class Policy, bool Weak>
+bool split_ref_word<Policy, Weak>::compare_exchange(block *expected, block *desired) noexcept
+{
+  uint64_t cur = word.load(std::memory_order_relaxed);
+  // Only concurrent loads can make the exchange fail with expected still stored
+  while (unpack(cur) == expected)
+  {
+    if (word.compare_exchange_weak(cur, pack(desired), std::memory_order_acq_rel, std::memory_order_relaxed))
+    {
+      if (expected != nullptr)
+      {
+        del(expected, batch - local(cur));
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+// shared_ptr that can be loaded and stored from many threads at once
+// without locks. Only the control block is stored: the object address is
+// asked from the block, and a pointer to anything but the object owned by
+// its block (an aliased or converted one) gets a block of its own on store.
+// While stored, use_count() also counts the references kept in reserve,
+// which only the stored word knows how many of are claimed. So the count
+// of a stored pointer is at least that reserve, and wait_until_unique()
+// or wait_for_release() on it only return once it is no longer stored
+template<typename T, class Policy = default_policy>
+struct atomic_shared_ptr
+{
+public:
+  using value_type = shared_ptr<T, Policy>;
+
+  atomic_shared_ptr() noexcept = default;
+  atomic_shared_ptr(shared_ptr<T, Policy> desired);
+
+  atomic_shared_ptr(const atomic_shared_ptr &) = delete;
+  atomic_shared_ptr & operator=(const atomic_shared_ptr &) = delete;
+
+  atomic_shared_ptr & operator=(shared_ptr<T, Policy> desired);
+
+  bool is_lock_free() const noexcept;
+
+  shared_ptr<T, Policy> load() const noexcept;
+  operator shared_ptr<T, Policy>() const noexcept;
+
+  void store(shared_ptr<T, Policy> desired);
+  shared_ptr<T, Policy> exchange(shared_ptr<T, Policy> desired);
+
+  // Succeeds if the stored pointer is expected, sharing ownership with it.
+  // On failure expected gets the stored value
+  bool compare_exchange_weak(shared_ptr<T, Policy> &expected, shared_ptr<T, Policy> desired);
+  bool compare_exchange_strong(shared_ptr<T, Policy> &expected, shared_ptr<T, Policy> desired);
+
+  // Blocks until the stored pointer is not old, as seen after a
+  // notify_all. As with compare_exchange, an aliased old never matches
+  void wait(const shared_ptr<T, Policy> &old) const;
+  // Wakes the threads in wait, to be called after a store
+  void notify_all() noexcept;
+
+private:
+  using element_type = std::remove_extent_t<T>;
+  using word_type = split_ref_word<Policy, false>;
+
+  // mutable since loads update the local count
+  mutable word_type word;
+  wait_word changes;
+
+  // Takes the reference of p and makes batch of it
+  static control_block<Policy> * release_prepared(shared_ptr<T, Policy> p);
+  static shared_ptr<T, Policy> adopt(control_block<Policy> *cblock) noexcept;
+};
+
+template<typename T, class Policy>
+control_block<Policy> * atomic_shared_ptr<T, Policy>::release_prepared(shared_ptr<T, Policy> p)
+{
+  control_block<Policy> *cblock = p.cblock;
+  if (cblock != nullptr && static_cast<const volatile void *>(p.ptr) != cblock->object())
+  {
+    element_type *ptr = p.ptr;
+    cblock = new regular_control_block<element_type, policy_bridge_deleter<T, Policy>, Policy>(
+        ptr, policy_bridge_deleter<T, Policy>{std::move(p)});
+  }
+  else
+  {
+    p.cblock = nullptr;
+    p.ptr = nullptr;
+  }
+  word_type::prepare(cblock);
+  return cblock;
+}
+
+template<typename T, class Policy>
+shared_ptr<T, Policy> atomic_shared_ptr<T, Policy>::adopt(control_block<Policy> *cblock) noexcept
+{
+  shared_ptr<T, Policy> res;
+  if (cblock != nullptr)
+  {
+    res.cblock = cblock;
+    res.ptr = static_cast<element_type *>(cblock->object());
+  }
+  return res;
+}
+
+template<typename T, class Policy>
+atomic_shared_ptr<T, Policy>::atomic_shared_ptr(shared_ptr<T, Policy> desired) :
+    word(release_prepared(std::move(desired)))
+{
+}
+
+template<typename T, class Policy>
+atomic_shared_ptr<T, Policy> & atomic_shared_ptr<T, Policy>::operator=(shared_ptr<T, Policy> desired)
+{
+  store(std::move(desired));
+  return *this;
+}
+
+template<typename T, class Policy>
+bool atomic_shared_ptr<T, Policy>::is_lock_free() const noexcept
+{
+  return word.is_lock_free();
+}
+
+template<typename T, class Policy>
+shared_ptr<T, Policy> atomic_shared_ptr<T, Policy>::load() const noexcept
+{
+  return adopt(word.load());
+}
+
+template<typename T, class Policy>
+atomic_shared_ptr<T, Policy>::operator shared_ptr<T, Policy>() const noexcept
+{
+  return load();
+}
+
+template<typename T, class Policy>
+void atomic_shared_ptr<T, Policy>::store(shared_ptr<T, Policy> desired)
+{
+  exchange(std::move(desired));
+}
+
+template<typename T, class Policy>
+shared_ptr<T, Policy> atomic_shared_ptr<T, Policy>::exchange(shared_ptr<T, Policy> desired)
+{
+  return adopt(word.exchange(release_prepared(std::move(desired))));
+}
+
+template<typename T, class Policy>
+bool atomic_shared_ptr<T, Policy>::compare_exchange_weak(shared_ptr<T, Policy> &expected,
+                                                         shared_ptr<T, Policy> desired)
+{
+  return compare_exchange_strong(expected, std::move(desired));
+}
+
+// A stored aliased pointer has a block of its own, so it never compares equal
+template<typename T, class Policy>
+bool atomic_shared_ptr<T, Policy>::compare_exchange_strong(shared_ptr<T, Policy> &expected,
+                                                           shared_ptr<T, Policy> desired)
+{
+  control_block<Policy> *cblock = expected.cblock;
+  if (cblock == nullptr || static_cast<const volatile void *>(expected.ptr) == cblock->object())
+  {
+    control_block<Policy> *prepared = release_prepared(std::move(desired));
+    if (word.compare_exchange(cblock, prepared))
+    {
+      return true;
+    }
+    word_type::unprepare(prepared);
+  }
+  expected = load();
+  return false;
+}
+
+template<typename T, class Policy>
+void atomic_shared_ptr<T, Policy>::wait(const shared_ptr<T, Policy> &old) const
+{
+  control_block<Policy> *cblock = old.cblock;
+  if (cblock != nullptr && static_cast<const volatile void *>(old.ptr) != cblock->object())
+    return;
+  changes.wait([&] { return word.peek() != cblock; });
+}
+
+template<typename T, class Policy>
+void atomic_shared_ptr<T, Policy>::notify_all() noexcept
+{
+  changes.notify_all();
+}
+
+// weak_ptr that can be loaded and stored from many threads at once without
+// locks. Only weak pointers to the object owned by their block can be stored,
+// others make store throw std::invalid_argument
+template<typename T, class Policy = default_policy>
+struct atomic_weak_ptr
+{
+public:
+  using value_type = weak_ptr<T, Policy>;
+
+  atomic_weak_ptr() noexcept = default;
+  atomic_weak_ptr(weak_ptr<T, Policy> desired);
+
+  atomic_weak_ptr(const atomic_weak_ptr &) = delete;
+  atomic_weak_ptr & operator=(const atomic_weak_ptr &) = delete;
+
+  atomic_weak_ptr & operator=(weak_ptr<T, Policy> desired);
+
+  bool is_lock_free() const noexcept;
+
+  weak_ptr<T, Policy> load() const noexcept;
+  operator weak_ptr<T, Policy>() const noexcept;
+
+  void store(weak_ptr<T, Policy> desired);
+  weak_ptr<T, Policy> exchange(weak_ptr<T, Policy> desired);
+
+  bool compare_exchange_weak(weak_ptr<T, Policy> &expected, weak_ptr<T, Policy> desired);
+  bool compare_exchange_strong(weak_ptr<T, Policy> &expected, weak_ptr<T, Policy> desired);
+
+private:
+  using element_type = std::remove_extent_t<T>;
+  using word_type = split_ref_word<Policy, true>;
+
+  mutable word_type word;
+
+  static control_block<Policy> * release_prepared(weak_ptr<T, Policy> p);
+  static weak_ptr<T, Policy> adopt(control_block<Policy> *cblock) noexcept;
+};
+
+template<typename T, class Policy>
+control_block<Policy> * atomic_weak_ptr<T, Policy>::release_prepared(weak_ptr<T, Policy> p)
+{
+  control_block<Policy> *cblock = p.cblock;
+  if (cblock != nullptr && static_cast<const volatile void *>(p.ptr) != cblock->object())
+  {
+    throw std::invalid_argument("atomic_weak_ptr: aliased pointers cannot be stored");
+  }
+  p.cblock = nullptr;
+  p.ptr = nullptr;
+  word_type::prepare(cblock);
+  return cblock;
+}
+
+template<typename T, class Policy>
+weak_ptr<T, Policy> atomic_weak_ptr<T, Policy>::adopt(control_block<Policy> *cblock) noexcept
+{
+  weak_ptr<T, Policy> res;
+  if (cblock != nullptr)
+  {
+    res.cblock = cblock;
+    res.ptr = static_cast<element_type *>(cblock->object());
+  }
+  return res;
+}
+
+template<typename T, class Policy>
+atomic_weak_ptr<T, Policy>::atomic_weak_ptr(weak_ptr<T, Policy> desired) :
+    word(release_prepared(std::move(desired)))
+{
+}
+
+template<typename T, class Policy>
+atomic_weak_ptr<T, Policy> & atomic_weak_ptr<T, Policy>::operator=(weak_ptr<T, Policy> desired)
+{
+  store(std::move(desired));
+  return *this;
+}
+
+template<typename T, class Policy>
+bool atomic_weak_ptr<T, Policy>::is_lock_free() const noexcept
+{
+  return word.is_lock_free();
+}
+
+template<typename T, class Policy>
+weak_ptr<T, Policy> atomic_weak_ptr<T, Policy>::load() const noexcept
+{
+  return adopt(word.load());
+}
+
+template<typename T, class Policy>
+atomic_weak_ptr<T, Policy>::operator weak_ptr<T, Policy>() const noexcept
+{
+  return load();
+}
+
+template<typename T, class Policy>
+void atomic_weak_ptr<T, Policy>::store(weak_ptr<T, Policy> desired)
+{
+  exchange(std::move(desired));
+}
+
+template<typename T, class Policy>
+weak_ptr<T, Policy> atomic_weak_ptr<T, Policy>::exchange(weak_ptr<T, Policy> desired)
+{
+  return adopt(word.exchange(release_prepared(std::move(desired))));
+}
+
+template<typename T, class Policy>
+bool atomic_weak_ptr<T, Policy>::compare_exchange_weak(weak_ptr<T, Policy> &expected,
+                                                       weak_ptr<T, Policy> desired)
+{
+  return compare_exchange_strong(expected, std::move(desired));
+}
+
+template<typename T, class Policy>
+bool atomic_weak_ptr<T, Policy>::compare_exchange_strong(weak_ptr<T, Policy> &expected,
+                                                         weak_ptr<T, Policy> desired)
+{
+  control_block<Policy> *cblock = expected.cblock;
+  if (cblock == nullptr || static_cast<const volatile void *>(expected.ptr) == cblock->object())
+  {
+    control_block<Policy> *prepared = release_prepared(std::move(desired));
+    if (word.compare_exchange(cblock, prepared))
+    {
+      return true;
+    }
+    word_type::unprepare(prepared);
+  }
+  expected = load();
+  return false;
+}
+
+#endif /* ATOMIC_SHARED_PTR_H_ */
@@ -0,0 +1,469 @@
+// Micro-benchmarks; build with -DCMAKE_BUILD_TYPE=Release for meaningful numbers.
+// Usage: shared_ptr_benchmark [name-prefix]
+
+#include "shared_ptr.h"
+#include "compact_shared_ptr.h"
+#include "atomic_shared_ptr.h"
+#include "reaper.h"
+#include "destruction_queue.h"
+#include "epoch.h"
+#include "hazard.h"
+#include "snapshot_cell.h"
+#include "weak_ptr.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace
+{
+  // Keeps the compiler from optimizing away the value and the memory behind it
+  template<typename T>
+  void do_not_optimize(T &value)
+  {
+#if defined(__GNUC__)
+    asm volatile("" : : "r"(&value) : "memory");
+#else
+    static volatile const void *sink;
+    sink = &value;
+#endif
+  }
+
+  const char *filter = "";
+
+  template<typename F>
+  void run(const char *name, size_t iterations, F f)
+  {
+    if (std::strncmp(name, filter, std::strlen(filter)) != 0)
+      return;
+    auto start = std::chrono::steady_clock::now();
+    f(iterations);
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    std::printf("%-40s %10.2f ns/op\n", name, elapsed.count() / iterations);
+  }
+
+  // Like run, but only the time spent in f(batch) is measured, not in setup(batch)
+  template<typename Setup, typename F>
+  void run_batches(const char *name, size_t batches, size_t batch_size, Setup setup, F f)
+  {
+    if (std::strncmp(name, filter, std::strlen(filter)) != 0)
+      return;
+    std::chrono::duration<double, std::nano> elapsed{0};
+    for (size_t i = 0; i < batches; i++)
+    {
+      auto batch = setup(batch_size);
+      auto start = std::chrono::steady_clock::now();
+      f(batch);
+      elapsed += std::chrono::steady_clock::now() - start;
+    }
+    std::printf("%-40s %10.2f ns/op\n", name, elapsed.count() / (batches * batch_size));
+  }
+
+  // Runs f(iterations) on each of n_threads threads started together
+  template<typename F>
+  void run_threads(const char *name, size_t n_threads, size_t iterations, F f)
+  {
+    char full_name[64];
+    std::snprintf(full_name, sizeof(full_name), "%s/%zu", name, n_threads);
+    run(full_name, iterations * n_threads, [&](size_t) {
+      std::vector<std::thread> threads;
+      for (size_t i = 0; i < n_threads; i++)
+        threads.emplace_back(f, iterations);
+      for (auto &t : threads)
+        t.join();
+    });
+  }
+
+  size_t max_threads()
+  {
+    return std::max<size_t>(8, 2 * std::thread::hardware_concurrency());
+  }
+
+  template<class Ptr>
+  void copy_destroy(const Ptr &p, size_t iterations)
+  {
+    for (size_t i = 0; i < iterations; i++)
+    {
+      Ptr q = p;
+      do_not_optimize(q);
+    }
+  }
+
+  void bench_copy()
+  {
+    const size_t n = 50'000'000;
+    {
+      shared_ptr<int, atomic_policy> p = make_shared<int, atomic_policy>(42);
+      run("copy/atomic_policy", n, [&](size_t n) { copy_destroy(p, n); });
+    }
+    {
+      shared_ptr<int, compact_atomic_policy> p = make_shared<int, compact_atomic_policy>(42);
+      run("copy/compact_atomic_policy", n, [&](size_t n) { copy_destroy(p, n); });
+    }
+    {
+      shared_ptr<int, single_threaded_policy> p = make_shared<int, single_threaded_policy>(42);
+      run("copy/single_threaded_policy", n, [&](size_t n) { copy_destroy(p, n); });
+    }
+    {
+      shared_ptr<int, biased_policy> p = make_shared<int, biased_policy>(42);
+      run("copy/biased_policy", n, [&](size_t n) { copy_destroy(p, n); });
+    }
+    {
+      std::shared_ptr<int> p = std::make_shared<int>(42);
+      run("copy/std::shared_ptr", n, [&](size_t n) { copy_destroy(p, n); });
+    }
+  }
+
+  void bench_lock()
+  {
+    const size_t n = 5'000'000;
+    shared_ptr<int> p = make_shared<int>(42);
+    weak_ptr<int> w = p;
+    for (size_t threads = 1; threads <= max_threads(); threads *= 2)
+      run_threads("weak_ptr::lock", threads, n, [&](size_t n) {
+        for (size_t i = 0; i < n; i++)
+        {
+          shared_ptr<int> q = w.lock();
+          do_not_optimize(q);
+        }
+      });
+  }
+
+  // Every thread copies the same pointer
+  template<class Policy>
+  void bench_shared_copy(const char *name)
+  {
+    const size_t n = 5'000'000;
+    shared_ptr<int, Policy> p = make_shared<int, Policy>(42);
+    for (size_t threads = 1; threads <= max_threads(); threads *= 2)
+      run_threads(name, threads, n, [&](size_t n) { copy_destroy(p, n); });
+  }
+
+  void bench_sharded()
+  {
+    bench_shared_copy<atomic_policy>("shared_copy/atomic_policy");
+    bench_shared_copy<sharded_policy>("shared_copy/sharded_policy");
+  }
+
+  void bench_teardown()
+  {
+    const size_t batches = 20, batch_size = 500'000;
+    auto clear = [](std::vector<shared_ptr<int>> &v) { v.clear(); };
+    run_batches("teardown/regular_control_block", batches, batch_size, [](size_t n) {
+      std::vector<shared_ptr<int>> v;
+      for (size_t i = 0; i < n; i++)
+        v.emplace_back(new int(42));
+      return v;
+    }, clear);
+    run_batches("teardown/inplace_control_block", batches, batch_size, [](size_t n) {
+      std::vector<shared_ptr<int>> v;
+      for (size_t i = 0; i < n; i++)
+        v.push_back(make_shared<int>(42));
+      return v;
+    }, clear);
+    // Copies of a few blocks, as left by a request's scratch structures
+    auto few_blocks = [](size_t n) {
+      shared_ptr<int> blocks[4] = {make_shared<int>(1), make_shared<int>(2), make_shared<int>(3), make_shared<int>(4)};
+      std::vector<shared_ptr<int>> v;
+      for (size_t i = 0; i < n; i++)
+        v.push_back(blocks[i % 4]);
+      return v;
+    };
+    run_batches("teardown/few_blocks", batches, batch_size, few_blocks, clear);
+    using deferred = deferred_policy<atomic_policy>;
+    run_batches("teardown/few_blocks_deferred", batches, batch_size, [](size_t n) {
+      shared_ptr<int, deferred> blocks[4] = {make_shared<int, deferred>(1), make_shared<int, deferred>(2),
+                                             make_shared<int, deferred>(3), make_shared<int, deferred>(4)};
+      std::vector<shared_ptr<int, deferred>> v;
+      for (size_t i = 0; i < n; i++)
+        v.push_back(blocks[i % 4]);
+      return v;
+    }, [](std::vector<shared_ptr<int, deferred>> &v) {
+      deferred_release_scope<deferred> scope;
+      v.clear();
+    });
+
+    // Time the releasing thread spends dropping the last reference to
+    // objects that each own a hundred more
+    using graph = std::vector<shared_ptr<int>>;
+    auto clear_graphs = [](std::vector<shared_ptr<graph>> &v) { v.clear(); };
+    run_batches("teardown/last_release", batches, batch_size / 100, [](size_t n) {
+      std::vector<shared_ptr<graph>> v;
+      for (size_t i = 0; i < n; i++)
+        v.push_back(make_shared<graph>(100, make_shared<int>(42)));
+      return v;
+    }, clear_graphs);
+    run_batches("teardown/last_release_reaped", batches, batch_size / 100, [](size_t n) {
+      reaper::flush();
+      std::vector<shared_ptr<graph>> v;
+      for (size_t i = 0; i < n; i++)
+        v.push_back(make_reaped<graph>(100, make_shared<int>(42)));
+      return v;
+    }, clear_graphs);
+    reaper::flush();
+    // The same teardown spread over frames of at most 20 us each
+    destruction_queue queue;
+    size_t frames = 0;
+    run_batches("teardown/last_release_queued", batches, batch_size / 100, [&](size_t n) {
+      std::vector<shared_ptr<graph>> v;
+      for (size_t i = 0; i < n; i++)
+        v.push_back(shared_ptr<graph>(new graph(100, make_shared<int>(42)), queued_delete<graph>(queue)));
+      return v;
+    }, clear_graphs);
+    run_batches("teardown/queued_drain", 1, batches * batch_size / 100, [](size_t) { return 0; }, [&](int) {
+      while (queue.drain(size_t(-1), std::chrono::microseconds(20)) != 0)
+        frames++;
+    });
+    if (frames != 0)
+      std::printf("%-40s %10zu\n", "teardown/queued_drain frames", frames);
+  }
+
+  void bench_alloc()
+  {
+    const size_t n = 10'000'000;
+    run("alloc/make_shared", n, [](size_t n) {
+      for (size_t i = 0; i < n; i++)
+      {
+        shared_ptr<int> p = make_shared<int>(42);
+        do_not_optimize(p);
+      }
+    });
+    run("alloc/shared_ptr(new)", n, [](size_t n) {
+      for (size_t i = 0; i < n; i++)
+      {
+        shared_ptr<int> p(new int(42));
+        do_not_optimize(p);
+      }
+    });
+    run("alloc/std::make_shared", n, [](size_t n) {
+      for (size_t i = 0; i < n; i++)
+      {
+        std::shared_ptr<int> p = std::make_shared<int>(42);
+        do_not_optimize(p);
+      }
+    });
+    // Blocks made on this thread and released on another one
+    const size_t batch = 100'000;
+    run("alloc/cross_thread", n, [](size_t n) {
+      for (size_t done = 0; done < n; done += batch)
+      {
+        std::vector<shared_ptr<int>> v;
+        v.reserve(batch);
+        for (size_t i = 0; i < batch; i++)
+          v.push_back(make_shared<int>(42));
+        std::thread([v = std::move(v)]() mutable { v.clear(); }).join();
+      }
+    });
+  }
+
+  // Fresh large allocations come straight from the system,
+  // so only the pages actually written get touched
+  void bench_for_overwrite()
+  {
+    const size_t n = 200;
+    static const size_t size = 4 << 20;
+    run("4MiB_buffer/make_shared", n, [](size_t n) {
+      for (size_t i = 0; i < n; i++)
+      {
+        shared_ptr<char[]> p = make_shared<char[]>(size);
+        do_not_optimize(p);
+      }
+    });
+    run("4MiB_buffer/make_shared_for_overwrite", n, [](size_t n) {
+      for (size_t i = 0; i < n; i++)
+      {
+        shared_ptr<char[]> p = make_shared_for_overwrite<char[]>(size);
+        do_not_optimize(p);
+      }
+    });
+  }
+
+  // Walks a large vector of pointers reading the objects
+  template<class Ptr, class Make>
+  void bench_vector_walk(const char *name, Make make)
+  {
+    const size_t size = 1'000'000, passes = 20;
+    std::vector<Ptr> v;
+    for (size_t i = 0; i < size; i++)
+      v.push_back(make(int(i)));
+    run(name, size * passes, [&](size_t) {
+      long sum = 0;
+      for (size_t pass = 0; pass < passes; pass++)
+        for (const Ptr &p : v)
+          sum += *p;
+      do_not_optimize(sum);
+    });
+  }
+
+  void bench_compact()
+  {
+    bench_vector_walk<shared_ptr<int>>("vector_walk/shared_ptr", [](int i) { return make_shared<int>(i); });
+    bench_vector_walk<compact_shared_ptr<int>>("vector_walk/compact_shared_ptr",
+                                               [](int i) { return make_compact_shared<int>(i); });
+  }
+
+  // Baseline for atomic_shared_ptr
+  struct locked_shared_ptr
+  {
+    shared_ptr<int> load()
+    {
+      std::lock_guard<std::mutex> lg(lock);
+      return value;
+    }
+
+    void store(shared_ptr<int> desired)
+    {
+      std::lock_guard<std::mutex> lg(lock);
+      std::swap(value, desired);
+    }
+
+    std::mutex lock;
+    shared_ptr<int> value = make_shared<int>(0);
+  };
+
+  // Every thread loads, and stores once per 1024 loads
+  template<class Cell>
+  void bench_read_mostly(const char *name)
+  {
+    const size_t n = 1'000'000;
+    Cell cell;
+    cell.store(make_shared<int>(0));
+    for (size_t threads = 1; threads <= 64; threads *= 2)
+      run_threads(name, threads, n / threads, [&](size_t n) {
+        for (size_t i = 0; i < n; i++)
+        {
+          if (i % 1024 == 0)
+            cell.store(make_shared<int>(int(i)));
+          shared_ptr<int> p = cell.load();
+          do_not_optimize(p);
+        }
+      });
+  }
+
+  // Readers use the published pointer inside an epoch_guard without
+  // touching counts; writers publish under a lock
+  struct epoch_cell
+  {
+    void store(shared_ptr<int> desired)
+    {
+      std::lock_guard<std::mutex> lg(lock);
+      published.store(desired.get(), std::memory_order_release);
+      std::swap(owner, desired);
+    }
+
+    std::mutex lock;
+    shared_ptr<int> owner;
+    std::atomic<int *> published{nullptr};
+  };
+
+  void bench_epoch()
+  {
+    const size_t n = 1'000'000;
+    epoch_cell cell;
+    cell.store(make_epoch_reclaimed<int>(0));
+    for (size_t threads = 1; threads <= 64; threads *= 2)
+      run_threads("read_mostly/epoch", threads, n / threads, [&](size_t n) {
+        for (size_t i = 0; i < n; i++)
+        {
+          if (i % 1024 == 0)
+            cell.store(make_epoch_reclaimed<int>(int(i)));
+          epoch_guard guard;
+          int *p = cell.published.load(std::memory_order_acquire);
+          do_not_optimize(p);
+        }
+      });
+    cell.store(nullptr);
+    epoch::flush();
+  }
+
+  void bench_hazard()
+  {
+    const size_t n = 1'000'000;
+    hazard_cell<int> cell(make_shared<int>(0));
+    for (size_t threads = 1; threads <= 64; threads *= 2)
+      run_threads("read_mostly/hazard_ptr", threads, n / threads, [&](size_t n) {
+        for (size_t i = 0; i < n; i++)
+        {
+          if (i % 1024 == 0)
+            cell.store(make_shared<int>(int(i)));
+          hazard_ptr<int> p(cell);
+          do_not_optimize(p);
+        }
+      });
+  }
+
+  void bench_snapshot()
+  {
+    const size_t n = 1'000'000;
+    snapshot_cell<int> cell(make_shared<int>(0));
+    for (size_t threads = 1; threads <= 64; threads *= 2)
+      run_threads("read_mostly/snapshot_cell", threads, n / threads, [&](size_t n) {
+        for (size_t i = 0; i < n; i++)
+        {
+          if (i % 1024 == 0)
+            cell.publish(make_shared<int>(int(i)));
+          snapshot_guard<int> p = cell.read();
+          do_not_optimize(p);
+        }
+      });
+  }
+
+  void bench_wait()
+  {
+    const size_t n = 100'000;
+    shared_ptr<int> value = make_shared<int>(0);
+    run("wait/notify_no_waiters", n, [&](size_t n) {
+      atomic_shared_ptr<int> cell(value);
+      for (size_t i = 0; i < n; i++)
+      {
+        cell.store(value);
+        cell.notify_all();
+      }
+    });
+    // A new value and the reply to it, each woken through the futex
+    run("wait/round_trip", n, [&](size_t n) {
+      snapshot_cell<int> request(value), reply(value);
+      std::thread echo([&] {
+        for (uint64_t v = 1; v <= n; v++)
+        {
+          request.wait(v);
+          reply.publish(value);
+        }
+      });
+      for (uint64_t v = 1; v <= n; v++)
+      {
+        request.publish(value);
+        reply.wait(v);
+      }
+      echo.join();
+    });
+  }
+
+  void bench_atomic()
+  {
+    bench_read_mostly<atomic_shared_ptr<int>>("read_mostly/atomic_shared_ptr");
+    bench_read_mostly<locked_shared_ptr>("read_mostly/mutex");
+    bench_epoch();
+    bench_hazard();
+    bench_snapshot();
+    bench_wait();
+  }
+}
+
+int main(int argc, char **argv)
+{
+  if (argc > 1)
+    filter = argv[1];
+  bench_copy();
+  bench_lock();
+  bench_sharded();
+  bench_teardown();
+  bench_alloc();
+  bench_for_overwrite();
+  bench_compact();
+  bench_atomic();
+}
@@ -0,0 +1,191 @@
+#include "control_block.h"
+#include <new>
+#include <thread>
+
+biased_thread_record biased_thread_record::none;
+
+namespace
+{
+  // Marks the list of a finished thread, which takes no more blocks
+  biased_policy * closed() noexcept
+  {
+    return reinterpret_cast<biased_policy *>(alignof(biased_policy));
+  }
+
+  thread_local bool finished = false;
+
+  // Every record made, never freed
+  std::atomic<biased_thread_record *> records{nullptr};
+}
+
+// Merges what is left when the thread finishes and closes its list
+struct biased_exit
+{
+  ~biased_exit()
+  {
+    biased_thread_record *record = biased_policy::current;
+    biased_policy::current = nullptr;
+    finished = true;
+    biased_policy::merge_list(record->pending.exchange(closed(), std::memory_order_acq_rel));
+  }
+};
+
+biased_thread_record * biased_policy::current_record() noexcept
+{
+  if (current != nullptr)
+  {
+    if (current->pending.load(std::memory_order_relaxed) != nullptr)
+      merge_pending();
+    return current;
+  }
+  // Without a record the block is counted atomically from the start
+  if (finished)
+    return &biased_thread_record::none;
+  current = new(std::nothrow) biased_thread_record;
+  if (current == nullptr)
+    return &biased_thread_record::none;
+  current->next_record = records.load(std::memory_order_relaxed);
+  while (!records.compare_exchange_weak(current->next_record, current, std::memory_order_relaxed))
+  {
+  }
+  static thread_local biased_exit exit;
+  return current;
+}
+
+biased_policy::biased_policy(release_fn release) noexcept :
+    home(current_record()), owner(home),
+    biased(home == &biased_thread_record::none ? 0 : 1),
+    shared(home == &biased_thread_record::none ? count_one | merged : 0),
+    release(release)
+{
+}
+
+void biased_policy::merge_pending() noexcept
+{
+  if (current != nullptr)
+    merge_list(current->pending.exchange(nullptr, std::memory_order_acquire));
+}
+
+bool biased_policy::merge_pending(const biased_policy *self) noexcept
+{
+  return merge_list(current->pending.exchange(nullptr, std::memory_order_acquire), self);
+}
+
+bool biased_policy::merge_list(biased_policy *list, const biased_policy *self) noexcept
+{
+  bool self_last = false;
+  while (list != nullptr)
+  {
+    // The block may be gone right after the merge
+    biased_policy *next = list->next_pending;
+    if (list->merge())
+    {
+      if (list == self)
+        self_last = true;
+      else
+        list->release(list);
+    }
+    list = next;
+  }
+  return self_last;
+}
+
+// The owner's count is zero, so the shared one is the total
+bool biased_policy::merge_owned() noexcept
+{
+  owner.store(&biased_thread_record::none, std::memory_order_relaxed);
+  int64_t old = shared.fetch_or(merged, std::memory_order_acq_rel);
+  if ((old & queued) == 0)
+    return (old >> flag_bits) == 0;
+  // Queued for this thread, which merges it right away. Whoever queued it
+  // may still be adding it to the list; until it has, no other thread
+  // releases it, and the queued flag stays set
+  for (;;)
+  {
+    biased_policy *list = home->pending.exchange(nullptr, std::memory_order_acquire);
+    bool found = false;
+    for (biased_policy *p = list; p != nullptr && !found; p = p->next_pending)
+      found = p == this;
+    bool last = merge_list(list, this);
+    if (found)
+      return last;
+    std::this_thread::yield();
+  }
+}
+
+bool biased_policy::del_shared(size_t n) noexcept
+{
+  int64_t old = shared.load(std::memory_order_relaxed);
+  if ((old & merged) != 0)
+  {
+    old = shared.fetch_sub(int64_t(n) * count_one, decrement_order);
+    if ((old >> flag_bits) == int64_t(n) && (old & queued) == 0)
+    {
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return true;
+    }
+    return false;
+  }
+
+  // Queued at the first time the count goes negative, in the same step
+  int64_t desired;
+  do
+  {
+    desired = old - int64_t(n) * count_one;
+    if ((old & merged) == 0 && (desired >> flag_bits) < 0)
+      desired |= queued;
+  } while (!shared.compare_exchange_weak(old, desired, std::memory_order_acq_rel, std::memory_order_relaxed));
+
+  if ((desired & queued) != 0 && (old & queued) == 0)
+  {
+    enqueue();
+    return false;
+  }
+  return (old & merged) != 0 && (desired >> flag_bits) == 0 && (desired & queued) == 0;
+}
+
+void biased_policy::enqueue() noexcept
+{
+  biased_policy *head = home->pending.load(std::memory_order_acquire);
+  do
+  {
+    if (head == closed())
+    {
+      // The owner's last writes are visible through the closed list
+      if (merge())
+        release(this);
+      return;
+    }
+    next_pending = head;
+  } while (!home->pending.compare_exchange_weak(head, this, std::memory_order_release, std::memory_order_acquire));
+}
+
+// Called by the owner, or by anyone once the owner has finished,
+// with queued set, so nobody else releases the block meanwhile
+bool biased_policy::merge() noexcept
+{
+  size_t own = biased.load(std::memory_order_relaxed);
+  biased.store(0, std::memory_order_relaxed);
+  owner.store(&biased_thread_record::none, std::memory_order_relaxed);
+  int64_t old = shared.load(std::memory_order_relaxed), desired;
+  do
+  {
+    desired = ((old >> flag_bits) + int64_t(own)) * count_one | merged;
+  } while (!shared.compare_exchange_weak(old, desired, std::memory_order_acq_rel, std::memory_order_relaxed));
+  return (desired >> flag_bits) == 0;
+}
+
+void biased_policy::release_block(biased_policy *counts) noexcept
+{
+  using block = control_block<biased_policy>;
+  auto *cblock = reinterpret_cast<block *>(reinterpret_cast<char *>(counts) - offsetof(block, counts));
+  cblock->release_object();
+}
+
+void deferred_policy<biased_policy>::release_block(biased_policy *counts) noexcept
+{
+  using block = control_block<deferred_policy>;
+  auto *deferred = static_cast<deferred_policy *>(counts);
+  auto *cblock = reinterpret_cast<block *>(reinterpret_cast<char *>(deferred) - offsetof(block, counts));
+  cblock->release_object();
+}
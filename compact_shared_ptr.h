@@ -0,0 +1,177 @@
+#ifndef COMPACT_SHARED_PTR_H_
+#define COMPACT_SHARED_PTR_H_
+
+#include "shared_ptr.h"
+
+// Owning pointer of a single word to an object made by make_compact_shared.
+// The object always lives in its inplace_control_block, so its address is
+// derived from the block instead of being stored. Aliasing and custom deleters
+// are not possible; convert to shared_ptr for those
+template<typename T, class Policy = default_policy>
+struct compact_shared_ptr
+{
+  static_assert(!std::is_array_v<T>, "arrays are not supported");
+public:
+  using element_type = T;
+
+  compact_shared_ptr() noexcept = default;
+  compact_shared_ptr(std::nullptr_t) noexcept;
+
+  compact_shared_ptr(const compact_shared_ptr &other) noexcept;
+  compact_shared_ptr(compact_shared_ptr &&other) noexcept;
+
+  compact_shared_ptr & operator=(const compact_shared_ptr &other) noexcept;
+  compact_shared_ptr & operator=(compact_shared_ptr &&other) noexcept;
+
+  ~compact_shared_ptr();
+
+  void reset() noexcept;
+
+  T * get() const noexcept;
+  T & operator*() const noexcept;
+  T * operator->() const noexcept;
+
+  explicit operator bool() const noexcept;
+
+  size_t use_count() const noexcept;
+
+  // Shares ownership with the full pointer, which points to the same object
+  template<typename Y, typename = std::enable_if_t<std::is_convertible_v<T *, Y *>>>
+  operator shared_ptr<Y, Policy>() const & noexcept;
+
+  template<typename Y, typename = std::enable_if_t<std::is_convertible_v<T *, Y *>>>
+  operator shared_ptr<Y, Policy>() && noexcept;
+
+private:
+  using block = inplace_control_block<T, Policy>;
+
+  block *cblock = nullptr;
+
+  template<typename Y, class P>
+  friend void swap(compact_shared_ptr<Y, P> &left, compact_shared_ptr<Y, P> &right) noexcept;
+
+  template<typename Y, class P, typename ...Args>
+  friend compact_shared_ptr<Y, P> make_compact_shared(Args&&... args);
+
+  template<typename Y, class P>
+  friend struct compact_weak_ptr;
+};
+
+template<typename T, class Policy>
+compact_shared_ptr<T, Policy>::compact_shared_ptr(std::nullptr_t) noexcept {}
+
+template<typename T, class Policy>
+compact_shared_ptr<T, Policy>::compact_shared_ptr(const compact_shared_ptr &other) noexcept : cblock(other.cblock)
+{
+  if (cblock != nullptr)
+  {
+    cblock->add_ref();
+  }
+}
+
+template<typename T, class Policy>
+compact_shared_ptr<T, Policy>::compact_shared_ptr(compact_shared_ptr &&other) noexcept : cblock(other.cblock)
+{
+  other.cblock = nullptr;
+}
+
+template<typename T, class Policy>
+void swap(compact_shared_ptr<T, Policy> &left, compact_shared_ptr<T, Policy> &right) noexcept
+{
+  std::swap(left.cblock, right.cblock);
+}
+
+template<typename T, class Policy>
+compact_shared_ptr<T, Policy> & compact_shared_ptr<T, Policy>::operator=(const compact_shared_ptr &other) noexcept
+{
+  compact_shared_ptr copy(other);
+  swap(copy, *this);
+  return *this;
+}
+
+template<typename T, class Policy>
+compact_shared_ptr<T, Policy> & compact_shared_ptr<T, Policy>::operator=(compact_shared_ptr &&other) noexcept
+{
+  if (cblock != other.cblock)
+  {
+    compact_shared_ptr empty;
+    swap(*this, empty);
+    swap(other, *this);
+  }
+  return *this;
+}
+
+template<typename T, class Policy>
+compact_shared_ptr<T, Policy>::~compact_shared_ptr()
+{
+  if (cblock != nullptr)
+  {
+    cblock->del_ref();
+  }
+}
+
+template<typename T, class Policy>
+void compact_shared_ptr<T, Policy>::reset() noexcept
+{
+  compact_shared_ptr empty;
+  swap(*this, empty);
+}
+
+template<typename T, class Policy>
+T * compact_shared_ptr<T, Policy>::get() const noexcept
+{
+  return cblock ? reinterpret_cast<T *>(&cblock->stg) : nullptr;
+}
+
+template<typename T, class Policy>
+T & compact_shared_ptr<T, Policy>::operator*() const noexcept
+{
+  return *reinterpret_cast<T *>(&cblock->stg);
+}
+
+template<typename T, class Policy>
+T * compact_shared_ptr<T, Policy>::operator->() const noexcept
+{
+  return reinterpret_cast<T *>(&cblock->stg);
+}
+
+template<typename T, class Policy>
+compact_shared_ptr<T, Policy>::operator bool() const noexcept
+{
+  return cblock;
+}
+
+template<typename T, class Policy>
+size_t compact_shared_ptr<T, Policy>::use_count() const noexcept
+{
+  return cblock ? cblock->ref_count() : 0;
+}
+
+template<typename T, class Policy>
+template<typename Y, typename>
+compact_shared_ptr<T, Policy>::operator shared_ptr<Y, Policy>() const & noexcept
+{
+  return shared_ptr<Y, Policy>(static_cast<control_block<Policy> *>(cblock), get());
+}
+
+template<typename T, class Policy>
+template<typename Y, typename>
+compact_shared_ptr<T, Policy>::operator shared_ptr<Y, Policy>() && noexcept
+{
+  shared_ptr<Y, Policy> res;
+  res.cblock = cblock;
+  res.ptr = get();
+  cblock = nullptr;
+  return res;
+}
+
+// Always keeps the object in place, regardless of its size
+template<typename T, class Policy = default_policy, typename ...Args>
+compact_shared_ptr<T, Policy> make_compact_shared(Args&&... args)
+{
+  compact_shared_ptr<T, Policy> res;
+  res.cblock = new inplace_control_block<T, Policy>(std::forward<Args>(args)...);
+  return res;
+}
+
+#endif /* COMPACT_SHARED_PTR_H_ */
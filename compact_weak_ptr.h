@@ -0,0 +1,186 @@
+#ifndef COMPACT_WEAK_PTR_H_
+#define COMPACT_WEAK_PTR_H_
+
+#include <cstdint>
+#include "compact_shared_ptr.h"
+
+// Weak reference of a single word. Usually only the control block is kept
+// and lock() asks the block for the object address. A pointer to anything but
+// the object owned by the block (an aliased or converted one) does not fit,
+// so the block and the pointer go to a shared side slot on the heap instead
+template<typename T, class Policy = default_policy>
+struct compact_weak_ptr
+{
+  static_assert(Policy::has_weak, "the counting policy does not support weak references");
+
+public:
+  compact_weak_ptr() noexcept = default;
+
+  // Allocates a side slot if other is aliased
+  template<typename Y>
+  compact_weak_ptr(const shared_ptr<Y, Policy> &other);
+  compact_weak_ptr(const compact_shared_ptr<T, Policy> &other) noexcept;
+
+  compact_weak_ptr(const compact_weak_ptr &other) noexcept;
+  compact_weak_ptr(compact_weak_ptr &&other) noexcept;
+
+  compact_weak_ptr & operator=(const compact_weak_ptr &other) noexcept;
+  compact_weak_ptr & operator=(compact_weak_ptr &&other) noexcept;
+
+  ~compact_weak_ptr();
+
+  void reset() noexcept;
+
+  shared_ptr<T, Policy> lock() const noexcept;
+
+private:
+  using element_type = std::remove_extent_t<T>;
+
+  struct alias_slot
+  {
+    control_block<Policy> *cblock;
+    element_type *ptr;
+    std::conditional_t<Policy::is_thread_safe, atomic_counter, plain_counter> refs{1};
+  };
+
+  // Either a control_block * or an alias_slot * with the low bit set
+  uintptr_t word = 0;
+
+  static constexpr uintptr_t alias_tag = 1;
+
+  bool is_alias() const noexcept
+  {
+    return (word & alias_tag) != 0;
+  }
+
+  alias_slot * slot() const noexcept
+  {
+    return reinterpret_cast<alias_slot *>(word & ~alias_tag);
+  }
+
+  control_block<Policy> * block() const noexcept
+  {
+    return is_alias() ? slot()->cblock : reinterpret_cast<control_block<Policy> *>(word);
+  }
+
+  template<typename Y, class P>
+  friend void swap(compact_weak_ptr<Y, P> &left, compact_weak_ptr<Y, P> &right) noexcept;
+};
+
+template<typename T, class Policy>
+template<typename Y>
+compact_weak_ptr<T, Policy>::compact_weak_ptr(const shared_ptr<Y, Policy> &other)
+{
+  control_block<Policy> *cblock = other.cblock;
+  if (cblock == nullptr)
+  {
+    return;
+  }
+  element_type *ptr = other.get();
+  if (static_cast<const volatile void *>(ptr) == cblock->object())
+  {
+    word = reinterpret_cast<uintptr_t>(cblock);
+  }
+  else
+  {
+    static_assert(alignof(alias_slot) > alias_tag);
+    word = reinterpret_cast<uintptr_t>(new alias_slot{cblock, ptr}) | alias_tag;
+  }
+  cblock->add_weak();
+}
+
+template<typename T, class Policy>
+compact_weak_ptr<T, Policy>::compact_weak_ptr(const compact_shared_ptr<T, Policy> &other) noexcept :
+    word(reinterpret_cast<uintptr_t>(other.cblock))
+{
+  if (other.cblock != nullptr)
+  {
+    other.cblock->add_weak();
+  }
+}
+
+template<typename T, class Policy>
+compact_weak_ptr<T, Policy>::compact_weak_ptr(const compact_weak_ptr &other) noexcept : word(other.word)
+{
+  if (is_alias())
+  {
+    slot()->refs.increment();
+  }
+  else if (word != 0)
+  {
+    block()->add_weak();
+  }
+}
+
+template<typename T, class Policy>
+compact_weak_ptr<T, Policy>::compact_weak_ptr(compact_weak_ptr &&other) noexcept : word(other.word)
+{
+  other.word = 0;
+}
+
+template<typename T, class Policy>
+void swap(compact_weak_ptr<T, Policy> &left, compact_weak_ptr<T, Policy> &right) noexcept
+{
+  std::swap(left.word, right.word);
+}
+
+template<typename T, class Policy>
+compact_weak_ptr<T, Policy> & compact_weak_ptr<T, Policy>::operator=(const compact_weak_ptr &other) noexcept
+{
+  compact_weak_ptr copy(other);
+  swap(*this, copy);
+  return *this;
+}
+
+template<typename T, class Policy>
+compact_weak_ptr<T, Policy> & compact_weak_ptr<T, Policy>::operator=(compact_weak_ptr &&other) noexcept
+{
+  if (&other != this)
+  {
+    compact_weak_ptr empty;
+    swap(*this, empty);
+    swap(other, *this);
+  }
+  return *this;
+}
+
+// A side slot holds the one weak reference of all pointers sharing it
+template<typename T, class Policy>
+compact_weak_ptr<T, Policy>::~compact_weak_ptr()
+{
+  if (is_alias())
+  {
+    alias_slot *s = slot();
+    if (s->refs.decrement())
+    {
+      s->cblock->del_weak();
+      delete s;
+    }
+  }
+  else if (word != 0)
+  {
+    block()->del_weak();
+  }
+}
+
+template<typename T, class Policy>
+void compact_weak_ptr<T, Policy>::reset() noexcept
+{
+  compact_weak_ptr empty;
+  swap(*this, empty);
+}
+
+template<typename T, class Policy>
+shared_ptr<T, Policy> compact_weak_ptr<T, Policy>::lock() const noexcept
+{
+  shared_ptr<T, Policy> res;
+  control_block<Policy> *cblock = block();
+  if (cblock != nullptr && cblock->try_add_ref())
+  {
+    res.cblock = cblock;
+    res.ptr = is_alias() ? slot()->ptr : static_cast<element_type *>(cblock->object());
+  }
+  return res;
+}
+
+#endif /* COMPACT_WEAK_PTR_H_ */
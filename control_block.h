@@ -1,74 +1,557 @@
 #ifndef CONTROL_BLOCK_H_
 #define CONTROL_BLOCK_H_
 
+#include <algorithm>
+#include <cstdint>
 #include <utility>
 #include <type_traits>
 #include <memory>
+#include <new>
+#include <chrono>
+#include "control_block_pool.h"
+#include "deferred_release.h"
+#include "refcount_policy.h"
+#include "release_wait.h"
 
+// Keeps slow paths out of the inlined fast paths that call them
+#if defined(_MSC_VER)
+#define CONTROL_BLOCK_NOINLINE __declspec(noinline)
+#else
+#define CONTROL_BLOCK_NOINLINE __attribute__((noinline))
+#endif
+
+template<class Policy>
 struct control_block
 {
-  control_block() noexcept = default;
+  // Operations of a concrete block type, one static table per type
+  struct ops_table
+  {
+    void (*delete_object)(control_block *) noexcept;
+    void (*destroy)(control_block *) noexcept;
+    // Both of the above in one call
+    void (*dispose)(control_block *) noexcept;
+    // Address of the owned object, for pointers that do not store it
+    void * (*object)(control_block *) noexcept;
+  };
+
+  explicit control_block(const ops_table *ops) noexcept : ops(ops) {}
 
-  void add_ref() noexcept;
-  void add_weak() noexcept;
-  void del_ref() noexcept;
-  void del_weak() noexcept;
+  // n references at once, for owners that hand them out in batches
+  void add_ref(size_t n = 1) noexcept;
+  bool try_add_ref() noexcept;
+  void add_weak(size_t n = 1) noexcept;
+  void del_ref(size_t n = 1) noexcept;
+  void del_weak(size_t n = 1) noexcept;
 
   size_t ref_count() const noexcept;
+  // Blocks until at most threshold strong references are left or the
+  // timeout passes, returns whether they are. Woken by del_ref
+  bool wait_for_release(size_t threshold,
+                        std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max());
+  // For sharded_policy only
+  void collapse_counts() const noexcept
+  {
+    counts.collapse();
+  }
+
+  void delete_object() noexcept;
+  void * object() noexcept;
 
-  virtual void delete_object() noexcept = 0;
+  // Blocks come from the per-thread pool unless over-aligned
+  static void * operator new(size_t size);
+  static void * operator new(size_t size, std::align_val_t alignment);
+  static void operator delete(void *p, size_t size) noexcept;
+  static void operator delete(void *p, size_t size, std::align_val_t alignment) noexcept;
 protected:
-  virtual ~control_block() = default;
+  ~control_block() = default;
 
 private:
-  size_t n_shared_refs = 1, n_weak_refs = 1;
+  const ops_table *ops;
+  Policy counts;
+
+  // Slow paths taken once per block, kept out of line
+  CONTROL_BLOCK_NOINLINE void release_object() noexcept;
+  CONTROL_BLOCK_NOINLINE void release_block() noexcept;
+
+  // Policies that release blocks on their own
+  friend Policy;
+};
+
+template<class Block, class Policy>
+struct control_block_ops
+{
+  static void delete_object(control_block<Policy> *cblock) noexcept
+  {
+    static_cast<Block *>(cblock)->delete_object();
+  }
+
+  static void destroy(control_block<Policy> *cblock) noexcept
+  {
+    delete static_cast<Block *>(cblock);
+  }
+
+  static void dispose(control_block<Policy> *cblock) noexcept
+  {
+    Block *block = static_cast<Block *>(cblock);
+    block->delete_object();
+    delete block;
+  }
+
+  static void * object(control_block<Policy> *cblock) noexcept
+  {
+    return static_cast<Block *>(cblock)->object();
+  }
+
+  static constexpr typename control_block<Policy>::ops_table table = {&delete_object, &destroy, &dispose, &object};
 };
 
-template<typename T, class Deleter>
-struct regular_control_block final : control_block, Deleter
+template<typename T, class Deleter, class Policy>
+struct regular_control_block final : control_block<Policy>, Deleter
 {
   explicit regular_control_block(T *ptr, Deleter d);
-  void delete_object() noexcept override;
+  void delete_object() noexcept;
+  void * object() noexcept;
 private:
   T *ptr;
 };
 
-template<typename T>
-class shared_ptr;
+// Requests default-initialization instead of value-initialization,
+// so trivial types are left unwritten
+struct default_init_t
+{
+};
+
+inline constexpr default_init_t default_init{};
 
-template<typename T>
-struct inplace_control_block final : control_block
+template<typename T, class Policy>
+struct inplace_control_block final : control_block<Policy>
 {
   template<typename ...Args>
   explicit inplace_control_block(Args&&... args);
+  explicit inplace_control_block(default_init_t);
+
+  void delete_object() noexcept;
+  void * object() noexcept;
+
+  typename std::aligned_storage<sizeof(T), alignof(T)>::type stg;
+};
+
+// Element count, block and elements in one allocation
+template<typename T, class Policy>
+struct inplace_array_control_block final : control_block<Policy>
+{
+  static_assert(!std::is_array_v<T>, "multidimensional arrays are not supported");
+
+  // Elements are value-initialized, copied from init
+  // or default-initialized if init is default_init
+  template<typename ...Init>
+  static inplace_array_control_block * create(size_t count, const Init &...init);
+
+  void delete_object() noexcept;
+
+  static void destroy(control_block<Policy> *cblock) noexcept;
+  static void dispose(control_block<Policy> *cblock) noexcept;
+
+  static constexpr typename control_block<Policy>::ops_table table = {
+      &control_block_ops<inplace_array_control_block, Policy>::delete_object, &destroy, &dispose,
+      &control_block_ops<inplace_array_control_block, Policy>::object};
+
+  T * elements() noexcept;
+  void * object() noexcept;
+
+private:
+  size_t count;
+
+  static constexpr size_t elements_offset()
+  {
+    return (sizeof(inplace_array_control_block) + alignof(T) - 1) / alignof(T) * alignof(T);
+  }
+
+  static constexpr size_t alignment()
+  {
+    return std::max(alignof(inplace_array_control_block), alignof(T));
+  }
+
+  explicit inplace_array_control_block(size_t count) noexcept;
+
+  static void * allocate(size_t count);
+  static void deallocate(void *p, size_t count) noexcept;
+
+  template<typename ...Init>
+  static void construct(T *p, const Init &...init);
+  static void construct(T *p, default_init_t);
+};
+
+// Stores an allocator, taking no space when it is empty
+template<class Alloc, bool = std::is_empty_v<Alloc> && !std::is_final_v<Alloc>>
+struct allocator_holder : private Alloc
+{
+  explicit allocator_holder(const Alloc &alloc) : Alloc(alloc) {}
+
+  Alloc & get_allocator() noexcept
+  {
+    return *this;
+  }
+};
+
+template<class Alloc>
+struct allocator_holder<Alloc, false>
+{
+  explicit allocator_holder(const Alloc &alloc) : alloc(alloc) {}
+
+  Alloc & get_allocator() noexcept
+  {
+    return alloc;
+  }
+
+private:
+  Alloc alloc;
+};
+
+// Object and block in one piece of memory obtained from a user allocator
+template<typename T, class Alloc, class Policy>
+struct allocated_control_block final : control_block<Policy>,
+    allocator_holder<typename std::allocator_traits<Alloc>::template rebind_alloc<
+        allocated_control_block<T, Alloc, Policy>>>
+{
+  using allocator_type = typename std::allocator_traits<Alloc>::template rebind_alloc<allocated_control_block>;
+
+  template<typename ...Args>
+  explicit allocated_control_block(const allocator_type &alloc, Args&&... args);
+
+  void delete_object() noexcept;
+  void * object() noexcept;
 
-  void delete_object() noexcept override;
+  static void destroy(control_block<Policy> *cblock) noexcept;
+  static void dispose(control_block<Policy> *cblock) noexcept;
+
+  static constexpr typename control_block<Policy>::ops_table table = {
+      &control_block_ops<allocated_control_block, Policy>::delete_object, &destroy, &dispose,
+      &control_block_ops<allocated_control_block, Policy>::object};
 
   typename std::aligned_storage<sizeof(T), alignof(T)>::type stg;
+
+private:
+  using object_allocator = typename std::allocator_traits<Alloc>::template rebind_alloc<T>;
 };
 
-template<typename T, class Deleter>
-regular_control_block<T, Deleter>::regular_control_block(T * ptr, Deleter d) : Deleter(std::move(d)), ptr(ptr)
+template<class Policy>
+void control_block<Policy>::add_ref(size_t n) noexcept
+{
+  counts.add_ref(n);
+}
+
+template<class Policy>
+bool control_block<Policy>::try_add_ref() noexcept
 {
+  return counts.try_add_ref();
 }
 
-template<typename T, class Deleter>
-void regular_control_block<T, Deleter>::delete_object() noexcept
+template<class Policy>
+void control_block<Policy>::add_weak(size_t n) noexcept
+{
+  counts.add_weak(n);
+}
+
+template<class Policy>
+void control_block<Policy>::del_ref(size_t n) noexcept
+{
+  if constexpr (defers_releases<Policy>)
+  {
+    if (deferred_release_scope<Policy>::defer(this, n))
+    {
+      return;
+    }
+  }
+  if constexpr (counts_waiters<Policy>)
+  {
+    bool watched;
+    if (counts.del_ref(n, watched))
+    {
+      release_object();
+    }
+    else if (watched)
+    {
+      // Only the address is used, the block may be gone already
+      release_waiters::notify(this);
+    }
+  }
+  else if (counts.del_ref(n))
+  {
+    release_object();
+  }
+}
+
+template<class Policy>
+void control_block<Policy>::del_weak(size_t n) noexcept
+{
+  if (counts.del_weak(n))
+  {
+    release_block();
+  }
+}
+
+template<class Policy>
+void control_block<Policy>::release_object() noexcept
+{
+  if constexpr (Policy::has_weak)
+  {
+    if (!counts.sole_weak())
+    {
+      delete_object();
+      del_weak();
+      return;
+    }
+  }
+  // No weak references: nobody can observe the block any more,
+  // so it goes together with the object
+  ops->dispose(this);
+}
+
+template<class Policy>
+void control_block<Policy>::release_block() noexcept
+{
+  ops->destroy(this);
+}
+
+template<class Policy>
+size_t control_block<Policy>::ref_count() const noexcept
+{
+  return counts.ref_count();
+}
+
+template<class Policy>
+bool control_block<Policy>::wait_for_release(size_t threshold, std::chrono::nanoseconds timeout)
+{
+  static_assert(counts_waiters<Policy>, "releases must tell whether anyone waits on the block");
+  // The caller's reference keeps the block
+  counts.add_waiter();
+  bool res = release_waiters::wait_for(this, [&] { return ref_count() <= threshold; }, timeout);
+  counts.del_waiter();
+  return res;
+}
+
+template<class Policy>
+void control_block<Policy>::delete_object() noexcept
+{
+  ops->delete_object(this);
+}
+
+template<class Policy>
+void * control_block<Policy>::object() noexcept
+{
+  return ops->object(this);
+}
+
+template<class Policy>
+void * control_block<Policy>::operator new(size_t size)
+{
+  return control_block_pool::allocate(size);
+}
+
+template<class Policy>
+void * control_block<Policy>::operator new(size_t size, std::align_val_t alignment)
+{
+  return ::operator new(size, alignment);
+}
+
+template<class Policy>
+void control_block<Policy>::operator delete(void *p, size_t size) noexcept
+{
+  control_block_pool::deallocate(p, size);
+}
+
+template<class Policy>
+void control_block<Policy>::operator delete(void *p, size_t size, std::align_val_t alignment) noexcept
+{
+  ::operator delete(p, size, alignment);
+}
+
+template<typename T, class Deleter, class Policy>
+regular_control_block<T, Deleter, Policy>::regular_control_block(T * ptr, Deleter d) :
+    control_block<Policy>(&control_block_ops<regular_control_block, Policy>::table),
+    Deleter(std::move(d)), ptr(ptr)
+{
+}
+
+template<typename T, class Deleter, class Policy>
+void regular_control_block<T, Deleter, Policy>::delete_object() noexcept
 {
   Deleter::operator()(ptr);
 }
 
-template<typename T>
+template<typename T, class Deleter, class Policy>
+void * regular_control_block<T, Deleter, Policy>::object() noexcept
+{
+  return const_cast<void *>(static_cast<const volatile void *>(ptr));
+}
+
+template<typename T, class Policy>
 template<typename ...Args>
-inplace_control_block<T>::inplace_control_block(Args&&... args)
+inplace_control_block<T, Policy>::inplace_control_block(Args&&... args) :
+    control_block<Policy>(&control_block_ops<inplace_control_block, Policy>::table)
 {
   new(&stg) T(std::forward<Args>(args)...);
 }
 
-template<typename T>
-void inplace_control_block<T>::delete_object() noexcept
+template<typename T, class Policy>
+inplace_control_block<T, Policy>::inplace_control_block(default_init_t) :
+    control_block<Policy>(&control_block_ops<inplace_control_block, Policy>::table)
+{
+  new(&stg) T;
+}
+
+template<typename T, class Policy>
+void inplace_control_block<T, Policy>::delete_object() noexcept
 {
   reinterpret_cast<T *>(&stg)->~T();
 }
 
+template<typename T, class Policy>
+void * inplace_control_block<T, Policy>::object() noexcept
+{
+  return &stg;
+}
+
+template<typename T, class Policy>
+inplace_array_control_block<T, Policy>::inplace_array_control_block(size_t count) noexcept :
+    control_block<Policy>(&table), count(count)
+{
+}
+
+template<typename T, class Policy>
+void * inplace_array_control_block<T, Policy>::allocate(size_t count)
+{
+  if (count > (SIZE_MAX - elements_offset()) / sizeof(T))
+    throw std::bad_array_new_length();
+  size_t size = elements_offset() + count * sizeof(T);
+  if constexpr (alignment() > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+    return control_block<Policy>::operator new(size, std::align_val_t(alignment()));
+  else
+    return control_block<Policy>::operator new(size);
+}
+
+template<typename T, class Policy>
+void inplace_array_control_block<T, Policy>::deallocate(void *p, size_t count) noexcept
+{
+  size_t size = elements_offset() + count * sizeof(T);
+  if constexpr (alignment() > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+    control_block<Policy>::operator delete(p, size, std::align_val_t(alignment()));
+  else
+    control_block<Policy>::operator delete(p, size);
+}
+
+template<typename T, class Policy>
+template<typename ...Init>
+inplace_array_control_block<T, Policy> * inplace_array_control_block<T, Policy>::create(size_t count, const Init &...init)
+{
+  static_assert(sizeof...(Init) <= 1, "at most one initial value");
+  void *mem = allocate(count);
+  auto *block = ::new(mem) inplace_array_control_block(count);
+  T *elems = block->elements();
+  size_t constructed = 0;
+  try
+  {
+    for (; constructed < count; constructed++)
+      construct(elems + constructed, init...);
+  }
+  catch (...)
+  {
+    while (constructed > 0)
+      elems[--constructed].~T();
+    block->~inplace_array_control_block();
+    deallocate(mem, count);
+    throw;
+  }
+  return block;
+}
+
+template<typename T, class Policy>
+template<typename ...Init>
+void inplace_array_control_block<T, Policy>::construct(T *p, const Init &...init)
+{
+  ::new(static_cast<void *>(p)) T(init...);
+}
+
+template<typename T, class Policy>
+void inplace_array_control_block<T, Policy>::construct(T *p, default_init_t)
+{
+  ::new(static_cast<void *>(p)) T;
+}
+
+template<typename T, class Policy>
+void inplace_array_control_block<T, Policy>::delete_object() noexcept
+{
+  T *elems = elements();
+  for (size_t i = count; i > 0; i--)
+    elems[i - 1].~T();
+}
+
+template<typename T, class Policy>
+void inplace_array_control_block<T, Policy>::destroy(control_block<Policy> *cblock) noexcept
+{
+  auto *block = static_cast<inplace_array_control_block *>(cblock);
+  size_t count = block->count;
+  block->~inplace_array_control_block();
+  deallocate(block, count);
+}
+
+template<typename T, class Policy>
+void inplace_array_control_block<T, Policy>::dispose(control_block<Policy> *cblock) noexcept
+{
+  static_cast<inplace_array_control_block *>(cblock)->delete_object();
+  destroy(cblock);
+}
+
+template<typename T, class Policy>
+T * inplace_array_control_block<T, Policy>::elements() noexcept
+{
+  return reinterpret_cast<T *>(reinterpret_cast<char *>(this) + elements_offset());
+}
+
+template<typename T, class Policy>
+void * inplace_array_control_block<T, Policy>::object() noexcept
+{
+  return elements();
+}
+
+template<typename T, class Alloc, class Policy>
+template<typename ...Args>
+allocated_control_block<T, Alloc, Policy>::allocated_control_block(const allocator_type &alloc, Args&&... args) :
+    control_block<Policy>(&table), allocator_holder<allocator_type>(alloc)
+{
+  object_allocator obj_alloc(this->get_allocator());
+  std::allocator_traits<object_allocator>::construct(obj_alloc, reinterpret_cast<T *>(&stg),
+                                                     std::forward<Args>(args)...);
+}
+
+template<typename T, class Alloc, class Policy>
+void allocated_control_block<T, Alloc, Policy>::delete_object() noexcept
+{
+  object_allocator obj_alloc(this->get_allocator());
+  std::allocator_traits<object_allocator>::destroy(obj_alloc, reinterpret_cast<T *>(&stg));
+}
+
+template<typename T, class Alloc, class Policy>
+void * allocated_control_block<T, Alloc, Policy>::object() noexcept
+{
+  return &stg;
+}
+
+template<typename T, class Alloc, class Policy>
+void allocated_control_block<T, Alloc, Policy>::destroy(control_block<Policy> *cblock) noexcept
+{
+  auto *block = static_cast<allocated_control_block *>(cblock);
+  allocator_type alloc(std::move(block->get_allocator()));
+  block->~allocated_control_block();
+  std::allocator_traits<allocator_type>::deallocate(alloc, block, 1);
+}
+
+template<typename T, class Alloc, class Policy>
+void allocated_control_block<T, Alloc, Policy>::dispose(control_block<Policy> *cblock) noexcept
+{
+  static_cast<allocated_control_block *>(cblock)->delete_object();
+  destroy(cblock);
+}
+
 #endif /* CONTROL_BLOCK_H_ */
@@ -0,0 +1,160 @@
+#include "control_block_pool.h"
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+
+namespace
+{
+  // Chunks are carved from slabs aligned to their size,
+  // so the owner of a chunk is found from its address
+  constexpr size_t slab_size = 64 * 1024;
+  // Slabs are taken from the system this many at a time, so whatever the
+  // allocator loses to the alignment is spread over all of them
+  constexpr size_t slabs_per_region = 16;
+  constexpr size_t n_classes = control_block_pool::max_size / control_block_pool::alignment;
+
+  struct free_chunk
+  {
+    free_chunk *next;
+  };
+
+  struct thread_cache;
+
+  struct alignas(control_block_pool::alignment) slab_header
+  {
+    thread_cache *owner;
+  };
+
+  // Only touched by the owning thread
+  struct size_class
+  {
+    free_chunk *local = nullptr;
+    char *bump = nullptr, *bump_end = nullptr;
+  };
+
+  struct thread_cache
+  {
+    size_class classes[n_classes];
+    // Rest of the last region, not given to a size class yet
+    char *spare = nullptr, *spare_end = nullptr;
+    thread_cache *next_orphan = nullptr;
+
+    // Chunks freed by other threads, taken all at once by the owner
+    alignas(64) std::atomic<free_chunk *> remote[n_classes] = {};
+  };
+
+  std::mutex orphans_lock;
+  thread_cache *orphans = nullptr;
+
+  thread_local thread_cache *current = nullptr;
+
+  // Hands the cache over to the next thread when this one finishes
+  struct cache_release
+  {
+    ~cache_release()
+    {
+      std::lock_guard<std::mutex> lg(orphans_lock);
+      current->next_orphan = orphans;
+      orphans = current;
+      current = nullptr;
+    }
+  };
+
+  thread_cache * local_cache()
+  {
+    if (current == nullptr)
+    {
+      {
+        std::lock_guard<std::mutex> lg(orphans_lock);
+        if (orphans != nullptr)
+        {
+          current = orphans;
+          orphans = orphans->next_orphan;
+        }
+      }
+      if (current == nullptr)
+        current = new thread_cache;
+      static thread_local cache_release release;
+    }
+    return current;
+  }
+
+  void * new_slab(thread_cache *cache)
+  {
+    if (cache->spare == cache->spare_end)
+    {
+      void *mem = std::aligned_alloc(slab_size, slab_size * slabs_per_region);
+      if (mem == nullptr)
+        throw std::bad_alloc();
+      cache->spare = static_cast<char *>(mem);
+      cache->spare_end = cache->spare + slab_size * slabs_per_region;
+    }
+    void *slab = cache->spare;
+    cache->spare += slab_size;
+    return slab;
+  }
+
+  size_t class_of(size_t size) noexcept
+  {
+    return (size + control_block_pool::alignment - 1) / control_block_pool::alignment - 1;
+  }
+}
+
+void * control_block_pool::allocate(size_t size)
+{
+  if (size > max_size)
+    return ::operator new(size);
+
+  size_t cls = class_of(size);
+  thread_cache *cache = local_cache();
+  size_class &sc = cache->classes[cls];
+  if (sc.local == nullptr)
+    sc.local = cache->remote[cls].exchange(nullptr, std::memory_order_acquire);
+  if (sc.local != nullptr)
+  {
+    free_chunk *chunk = sc.local;
+    sc.local = chunk->next;
+    return chunk;
+  }
+
+  size_t chunk_size = (cls + 1) * alignment;
+  if (static_cast<size_t>(sc.bump_end - sc.bump) < chunk_size)
+  {
+    void *mem = new_slab(cache);
+    new(mem) slab_header{cache};
+    sc.bump = static_cast<char *>(mem) + sizeof(slab_header);
+    sc.bump_end = static_cast<char *>(mem) + slab_size;
+  }
+  void *res = sc.bump;
+  sc.bump += chunk_size;
+  return res;
+}
+
+void control_block_pool::deallocate(void *p, size_t size) noexcept
+{
+  if (size > max_size)
+  {
+    ::operator delete(p, size);
+    return;
+  }
+
+  size_t cls = class_of(size);
+  free_chunk *chunk = static_cast<free_chunk *>(p);
+  auto *slab = reinterpret_cast<slab_header *>(reinterpret_cast<uintptr_t>(p) & ~(slab_size - 1));
+  thread_cache *owner = slab->owner;
+  if (owner == current)
+  {
+    chunk->next = owner->classes[cls].local;
+    owner->classes[cls].local = chunk;
+    return;
+  }
+
+  std::atomic<free_chunk *> &remote = owner->remote[cls];
+  chunk->next = remote.load(std::memory_order_relaxed);
+  while (!remote.compare_exchange_weak(chunk->next, chunk,
+                                       std::memory_order_release, std::memory_order_relaxed))
+  {
+  }
+}
@@ -0,0 +1,20 @@
+#ifndef CONTROL_BLOCK_POOL_H_
+#define CONTROL_BLOCK_POOL_H_
+
+#include <cstddef>
+
+// Per-thread free lists of control block memory, one per 16-byte size class.
+// Blocks released on another thread go back to the owning thread's lists.
+// Memory is kept for reuse and never returned to the system; the lists of
+// a finished thread are taken over by the next thread that starts using the pool
+struct control_block_pool
+{
+  // Larger blocks go straight to the global allocator
+  static constexpr size_t max_size = 256;
+  static constexpr size_t alignment = 16;
+
+  static void * allocate(size_t size);
+  static void deallocate(void *p, size_t size) noexcept;
+};
+
+#endif /* CONTROL_BLOCK_POOL_H_ */
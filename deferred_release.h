@@ -0,0 +1,151 @@
+#ifndef DEFERRED_RELEASE_H_
+#define DEFERRED_RELEASE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include "refcount_policy.h"
+
+template<class Policy>
+struct control_block;
+
+// Counts like Policy, but strong decrements are buffered while a
+// deferred_release_scope of this policy is alive on the thread. Other
+// policies never look for a scope, so their releases cost nothing extra
+template<class Policy>
+struct deferred_policy : Policy
+{
+  static_assert(Policy::is_thread_safe, "plain decrements are too cheap to buffer");
+};
+
+// Blocks of both policies sit in the same pending lists, so each one
+// carries how to release itself
+template<>
+struct deferred_policy<biased_policy> : biased_policy
+{
+  deferred_policy() noexcept : biased_policy(&release_block) {}
+
+private:
+  static void release_block(biased_policy *counts) noexcept;
+};
+
+template<class Policy>
+inline constexpr bool defers_releases = false;
+
+template<class Policy>
+inline constexpr bool defers_releases<deferred_policy<Policy>> = true;
+
+// While a scope is alive on a thread, the strong reference decrements
+// the thread makes on blocks of Policy (a deferred_policy) are buffered,
+// summed per block and applied with one atomic operation per block when
+// the outermost scope ends or the buffer fills up. Objects are destroyed
+// then instead of at their last release, and weak references can still
+// lock them until that point. Decrements made while the buffer is being
+// applied (by the destructors it runs) are not deferred
+template<class Policy>
+struct deferred_release_scope
+{
+  static_assert(defers_releases<Policy>, "only blocks of a deferred_policy are buffered");
+
+  deferred_release_scope() noexcept
+  {
+    state.depth++;
+  }
+
+  deferred_release_scope(const deferred_release_scope &) = delete;
+  deferred_release_scope & operator=(const deferred_release_scope &) = delete;
+
+  ~deferred_release_scope()
+  {
+    if (--state.depth == 0)
+      flush();
+  }
+
+  // Applies the decrements buffered on this thread so far
+  static void flush() noexcept;
+
+  // Buffers n decrements of cblock if a scope is alive, returns whether it did
+  static bool defer(control_block<Policy> *cblock, size_t n) noexcept
+  {
+    buffer &b = state;
+    if (b.depth == 0 || b.flushing)
+      return false;
+    add(b, cblock, n);
+    return true;
+  }
+
+private:
+  static constexpr size_t capacity = 64;
+  // Flushed when this many blocks are buffered, so probes stay short
+  static constexpr size_t max_used = capacity * 3 / 4;
+
+  struct entry
+  {
+    control_block<Policy> *cblock;
+    size_t n;
+  };
+
+  // Open addressing by block address
+  struct buffer
+  {
+    size_t depth;
+    bool flushing;
+    size_t used;
+    entry entries[capacity];
+  };
+
+  static inline thread_local buffer state{};
+
+  static size_t slot_of(control_block<Policy> *cblock) noexcept
+  {
+    return (reinterpret_cast<uintptr_t>(cblock) >> 4) * 0x9E3779B97F4A7C15ull >> 58;
+  }
+
+  static void add(buffer &b, control_block<Policy> *cblock, size_t n) noexcept;
+};
+
+template<class Policy>
+void deferred_release_scope<Policy>::add(buffer &b, control_block<Policy> *cblock, size_t n) noexcept
+{
+  static_assert(capacity == 64, "slot_of takes the top 6 bits");
+  for (size_t i = slot_of(cblock);; i = (i + 1) % capacity)
+  {
+    entry &e = b.entries[i];
+    if (e.cblock == cblock)
+    {
+      e.n += n;
+      return;
+    }
+    if (e.cblock == nullptr)
+    {
+      if (b.used == max_used)
+      {
+        flush();
+        add(b, cblock, n);
+        return;
+      }
+      e = {cblock, n};
+      b.used++;
+      return;
+    }
+  }
+}
+
+template<class Policy>
+void deferred_release_scope<Policy>::flush() noexcept
+{
+  buffer &b = state;
+  b.flushing = true;
+  for (entry &e : b.entries)
+  {
+    if (e.cblock != nullptr)
+    {
+      control_block<Policy> *cblock = e.cblock;
+      e.cblock = nullptr;
+      cblock->del_ref(e.n);
+    }
+  }
+  b.used = 0;
+  b.flushing = false;
+}
+
+#endif /* DEFERRED_RELEASE_H_ */
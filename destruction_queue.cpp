@@ -0,0 +1,29 @@
+#include "destruction_queue.h"
+
+destruction_queue::~destruction_queue()
+{
+  drain_all();
+}
+
+size_t destruction_queue::drain(size_t max_objects, duration max_time)
+{
+  const bool timed = max_time != duration::max();
+  const auto start = timed ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+  size_t destroyed = 0;
+  while (destroyed < max_objects)
+  {
+    if (pending == nullptr)
+    {
+      pending = incoming.take_all();
+      if (pending == nullptr)
+        break;
+    }
+    if (timed && destroyed > 0 && std::chrono::steady_clock::now() - start >= max_time)
+      break;
+    retired_object *r = pending;
+    pending = r->next;
+    r->destroy(r);
+    destroyed++;
+  }
+  return destroyed;
+}
@@ -0,0 +1,72 @@
+#ifndef DESTRUCTION_QUEUE_H_
+#define DESTRUCTION_QUEUE_H_
+
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include "retired_object.h"
+
+// Objects waiting to be destroyed in small steps by whoever drains the
+// queue, e.g. once per frame. Any thread may queue objects; one thread at
+// a time may drain. Objects released by the destructors that drain runs
+// are queued as well if they were made with queued_delete, so a large
+// graph is spread over several calls instead of going down in one
+struct destruction_queue
+{
+  using duration = std::chrono::steady_clock::duration;
+
+  destruction_queue() = default;
+  destruction_queue(const destruction_queue &) = delete;
+  destruction_queue & operator=(const destruction_queue &) = delete;
+
+  // Destroys everything still queued, cascades included
+  ~destruction_queue();
+
+  void push(retired_object *r) noexcept
+  {
+    incoming.push(r);
+  }
+
+  // Destroys queued objects oldest first, until max_objects are gone,
+  // max_time has passed or there is nothing left. At least one object is
+  // destroyed if any is queued and max_objects is not zero. Returns the
+  // number of objects destroyed
+  size_t drain(size_t max_objects, duration max_time = duration::max());
+
+  // Destroys everything queued until the queue stays empty
+  size_t drain_all()
+  {
+    return drain(size_t(-1));
+  }
+
+  // Only meaningful on the draining thread, other threads may be queueing
+  bool empty() const noexcept
+  {
+    return pending == nullptr && incoming.empty();
+  }
+
+private:
+  retired_stack incoming;
+  // Taken from incoming, oldest first, only touched by the draining thread
+  retired_object *pending = nullptr;
+};
+
+// Deleter that queues the object with its own deleter on a destruction_queue
+template<typename T, class Deleter = std::default_delete<T>>
+struct queued_delete
+{
+  explicit queued_delete(destruction_queue &queue, Deleter d = Deleter()) : queue(&queue), d(std::move(d)) {}
+
+  template<typename Y>
+  void operator()(Y *ptr) noexcept
+  {
+    if (retired_object *r = retire_call(ptr, d))
+      queue->push(r);
+  }
+
+  destruction_queue *queue;
+  Deleter d;
+};
+
+#endif /* DESTRUCTION_QUEUE_H_ */
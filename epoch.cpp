@@ -0,0 +1,135 @@
+#include "epoch.h"
+#include <thread>
+
+std::atomic<epoch::record *> epoch::records{nullptr};
+std::atomic<uint64_t> epoch::global{1};
+retired_stack epoch::limbo[3];
+
+namespace
+{
+  // try_advance scans every record, so it is not done at every guard
+  constexpr size_t advance_interval = 64;
+
+  void destroy_all(retired_object *list) noexcept
+  {
+    while (list != nullptr)
+    {
+      retired_object *next = list->next;
+      list->destroy(list);
+      list = next;
+    }
+  }
+}
+
+// Gives the record back for the next thread
+struct epoch_exit
+{
+  ~epoch_exit()
+  {
+    if (epoch::current->retired_epoch != 0)
+      epoch::reclaim(epoch::current);
+    epoch::current->in_use.store(false, std::memory_order_release);
+    epoch::current = nullptr;
+  }
+};
+
+epoch::record * epoch::current_record() noexcept
+{
+  if (current != nullptr)
+    return current;
+  for (record *r = records.load(std::memory_order_acquire); r != nullptr; r = r->next)
+  {
+    if (!r->in_use.load(std::memory_order_relaxed) && !r->in_use.exchange(true, std::memory_order_acquire))
+    {
+      current = r;
+      break;
+    }
+  }
+  if (current == nullptr)
+  {
+    current = new record;
+    current->next = records.load(std::memory_order_relaxed);
+    while (!records.compare_exchange_weak(current->next, current, std::memory_order_release, std::memory_order_relaxed))
+    {
+    }
+  }
+  static thread_local epoch_exit exit;
+  return current;
+}
+
+void epoch::pin(record *r) noexcept
+{
+  r->state.store(global.load(std::memory_order_relaxed) << 1 | 1, std::memory_order_relaxed);
+  // Orders the pin before the reads it protects, against try_advance
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+void epoch::retire(retired_object *r) noexcept
+{
+  // The thread that moved the epoch to e - 1 drained this bucket while
+  // pinned, so before the epoch reached e. While pinned the epoch cannot
+  // move on to e + 2, so the bucket is not destroyed before its time
+  epoch_guard guard;
+  uint64_t e = global.load(std::memory_order_relaxed);
+  limbo[e % 3].push(r);
+  current->retired_epoch = e;
+}
+
+void epoch::quiescent(record *r) noexcept
+{
+  if (++r->guards_since_advance >= advance_interval)
+  {
+    r->guards_since_advance = 0;
+    reclaim(r);
+  }
+}
+
+void epoch::reclaim(record *r) noexcept
+{
+  // Destroyed when the epoch moves on from one past it. The destructors
+  // run by try_advance may retire more through r
+  while (r->retired_epoch != 0)
+  {
+    if (global.load(std::memory_order_relaxed) >= r->retired_epoch + 2)
+      r->retired_epoch = 0;
+    else if (!try_advance())
+      break;
+  }
+}
+
+bool epoch::try_advance() noexcept
+{
+  // Pinned to e until the bucket is drained. Otherwise, stalled after
+  // moving the epoch to e + 1, this thread would let others move it to
+  // e + 2 and retire into that bucket, then destroy what they retired.
+  // Guards left by the destructors run here are nested in this one, so
+  // they do not reclaim in turn
+  record *self = current_record();
+  if (self->depth++ == 0)
+    pin(self);
+  uint64_t e = self->state.load(std::memory_order_relaxed) >> 1;
+  bool advanced = global.load(std::memory_order_relaxed) == e;
+  for (record *r = records.load(std::memory_order_acquire); r != nullptr && advanced; r = r->next)
+  {
+    // Reads made by the readers before they left happen before the destruction
+    uint64_t state = r->state.load(std::memory_order_acquire);
+    if ((state & 1) != 0 && (state >> 1) != e)
+      advanced = false;
+  }
+  if (advanced && global.compare_exchange_strong(e, e + 1, std::memory_order_acq_rel, std::memory_order_relaxed))
+    destroy_all(limbo[(e + 2) % 3].take_all());
+  else
+    advanced = false;
+  if (--self->depth == 0)
+    self->state.store(0, std::memory_order_release);
+  return advanced;
+}
+
+void epoch::flush() noexcept
+{
+  while (!limbo[0].empty() || !limbo[1].empty() || !limbo[2].empty())
+  {
+    if (!try_advance())
+      std::this_thread::yield();
+  }
+}
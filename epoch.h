@@ -0,0 +1,117 @@
+#ifndef EPOCH_H_
+#define EPOCH_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include "retired_object.h"
+#include "shared_ptr.h"
+
+// Epoch-based reclamation. Readers run inside an epoch_guard and may use
+// raw pointers to objects released with epoch_delete without touching
+// their counts. Such an object is destroyed once every thread that was
+// inside a guard when it was released has left it; leaving the guard is
+// the thread's quiescent point. A reader that stays inside a guard holds
+// back every object released since, so guards should be short. A thread
+// that has released objects tries to move the epoch on every so many
+// guards it leaves, and when it finishes
+struct epoch
+{
+  // Hands r over to be destroyed after the current readers are done
+  static void retire(retired_object *r) noexcept;
+
+  // Waits until everything retired so far, and whatever it released in
+  // turn, has been destroyed. Must not be called inside a guard
+  static void flush() noexcept;
+
+private:
+  friend struct epoch_guard;
+  friend struct epoch_exit;
+
+  // Per thread, reused after the thread finishes
+  struct alignas(64) record
+  {
+    // Pinned epoch shifted left by one, with bit 0 set, or 0 when quiescent
+    std::atomic<uint64_t> state{0};
+    size_t depth = 0;
+    // Epoch of the latest object retired through this record and not
+    // yet destroyed, or 0. Left for the next thread to take the record
+    uint64_t retired_epoch = 0;
+    size_t guards_since_advance = 0;
+    std::atomic<bool> in_use{true};
+    record *next = nullptr;
+  };
+
+  static record * current_record() noexcept;
+  static void pin(record *r) noexcept;
+  // Called when the thread of r leaves its last guard with objects retired
+  static void quiescent(record *r) noexcept;
+  // Moves the epoch on until what r retired is destroyed, while no reader
+  // is in the way
+  static void reclaim(record *r) noexcept;
+  // Moves the epoch on if every pinned thread has seen it, and destroys
+  // what can no longer be reached. Returns whether the epoch moved
+  static bool try_advance() noexcept;
+
+  // Every record made, never freed
+  static std::atomic<record *> records;
+  static std::atomic<uint64_t> global;
+  // Released in epoch e, destroyed once the epoch reaches e + 2
+  static retired_stack limbo[3];
+  static inline thread_local record *current = nullptr;
+};
+
+// Pins the thread to the current epoch for its lifetime. Nests
+struct epoch_guard
+{
+  epoch_guard() noexcept : r(epoch::current_record())
+  {
+    if (r->depth++ == 0)
+      epoch::pin(r);
+  }
+
+  epoch_guard(const epoch_guard &) = delete;
+  epoch_guard & operator=(const epoch_guard &) = delete;
+
+  ~epoch_guard()
+  {
+    if (--r->depth == 0)
+    {
+      r->state.store(0, std::memory_order_release);
+      if (r->retired_epoch != 0)
+        epoch::quiescent(r);
+    }
+  }
+
+private:
+  epoch::record *r;
+};
+
+// Deleter that defers its own deleter until current readers are done
+template<typename T, class Deleter = std::default_delete<T>>
+struct epoch_delete
+{
+  epoch_delete() = default;
+  explicit epoch_delete(Deleter d) : d(std::move(d)) {}
+
+  template<typename Y>
+  void operator()(Y *ptr) noexcept
+  {
+    if (retired_object *r = retire_call(ptr, d))
+      epoch::retire(r);
+  }
+
+  Deleter d;
+};
+
+// Creates a T that readers inside an epoch_guard may use through raw
+// pointers. The object is kept apart from its block, as the block may go
+// before the object does
+template<typename T, class Policy = default_policy, typename ...Args>
+shared_ptr<T, Policy> make_epoch_reclaimed(Args&&... args)
+{
+  return shared_ptr<T, Policy>(new T(std::forward<Args>(args)...), epoch_delete<T>());
+}
+
+#endif /* EPOCH_H_ */
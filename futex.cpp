@@ -0,0 +1,81 @@
+#include "futex.h"
+
+#if defined(__linux__)
+
+#include <climits>
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex words are plain 32-bit integers");
+
+bool futex_wait(const std::atomic<uint32_t> &word, uint32_t expected, const std::chrono::nanoseconds *timeout) noexcept
+{
+  timespec ts, *pts = nullptr;
+  if (timeout != nullptr)
+  {
+    auto seconds = std::chrono::duration_cast<std::chrono::seconds>(*timeout);
+    ts.tv_sec = time_t(seconds.count());
+    ts.tv_nsec = long((*timeout - seconds).count());
+    pts = &ts;
+  }
+  // The futex only reads the word
+  long res = syscall(SYS_futex, const_cast<std::atomic<uint32_t> *>(&word), FUTEX_WAIT_PRIVATE, expected, pts, nullptr, 0);
+  return res == 0 || errno != ETIMEDOUT;
+}
+
+void futex_wake_all(const std::atomic<uint32_t> &word) noexcept
+{
+  syscall(SYS_futex, const_cast<std::atomic<uint32_t> *>(&word), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+}
+
+#else
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+namespace
+{
+  struct bucket
+  {
+    std::mutex lock;
+    std::condition_variable cv;
+  };
+
+  bucket buckets[64];
+
+  bucket & bucket_of(const void *p) noexcept
+  {
+    return buckets[(reinterpret_cast<uintptr_t>(p) >> 2) * 0x9E3779B97F4A7C15ull >> 58];
+  }
+}
+
+bool futex_wait(const std::atomic<uint32_t> &word, uint32_t expected, const std::chrono::nanoseconds *timeout) noexcept
+{
+  bucket &b = bucket_of(&word);
+  std::unique_lock<std::mutex> lock(b.lock);
+  // Wakers change the word before taking the lock
+  if (word.load(std::memory_order_relaxed) != expected)
+    return true;
+  if (timeout == nullptr)
+  {
+    b.cv.wait(lock);
+    return true;
+  }
+  return b.cv.wait_for(lock, *timeout) == std::cv_status::no_timeout;
+}
+
+void futex_wake_all(const std::atomic<uint32_t> &word) noexcept
+{
+  bucket &b = bucket_of(&word);
+  {
+    std::lock_guard<std::mutex> lock(b.lock);
+  }
+  b.cv.notify_all();
+}
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef FUTEX_H_
+#define FUTEX_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Blocks while word holds expected, until woken or timeout passes (null
+// for none). May return early. Returns false if the timeout passed.
+// Uses the futex system call on Linux and hashed condition variables elsewhere
+bool futex_wait(const std::atomic<uint32_t> &word, uint32_t expected,
+                const std::chrono::nanoseconds *timeout = nullptr) noexcept;
+void futex_wake_all(const std::atomic<uint32_t> &word) noexcept;
+
+// Lets threads sleep until a condition on some other state holds. The
+// state is changed first and notify_all called after; notifying costs a
+// system call only when somebody is asleep
+struct wait_word
+{
+  template<class Pred>
+  void wait(Pred pred) const
+  {
+    sleepers.fetch_add(1, std::memory_order_seq_cst);
+    for (;;)
+    {
+      uint32_t seen = word.load(std::memory_order_seq_cst);
+      if (pred())
+        break;
+      futex_wait(word, seen);
+    }
+    sleepers.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  // Returns pred(), false only if the timeout passed first
+  template<class Pred>
+  bool wait_for(Pred pred, std::chrono::nanoseconds timeout) const
+  {
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    sleepers.fetch_add(1, std::memory_order_seq_cst);
+    bool done;
+    for (;;)
+    {
+      uint32_t seen = word.load(std::memory_order_seq_cst);
+      if ((done = pred()))
+        break;
+      std::chrono::nanoseconds left = deadline - std::chrono::steady_clock::now();
+      if (left <= std::chrono::nanoseconds::zero())
+        break;
+      futex_wait(word, seen, &left);
+    }
+    sleepers.fetch_sub(1, std::memory_order_relaxed);
+    return done;
+  }
+
+  void notify_all() noexcept
+  {
+    word.fetch_add(1, std::memory_order_seq_cst);
+    if (sleepers.load(std::memory_order_seq_cst) != 0)
+      futex_wake_all(word);
+  }
+
+private:
+  std::atomic<uint32_t> word{0};
+  mutable std::atomic<uint32_t> sleepers{0};
+};
+
+#endif /* FUTEX_H_ */
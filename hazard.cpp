@@ -0,0 +1,139 @@
+#include "hazard.h"
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+
+std::atomic<hazard_pointers::record *> hazard_pointers::records{nullptr};
+std::atomic<size_t> hazard_pointers::n_records{0};
+
+namespace
+{
+  // Left behind by finished threads, taken by the next scan
+  std::mutex orphans_lock;
+  std::vector<std::pair<void *, void (*)(void *) noexcept>> orphans;
+}
+
+// Hands what is still protected to the other threads and gives the
+// record back for the next thread
+struct hazard_exit
+{
+  ~hazard_exit()
+  {
+    hazard_pointers::record *r = hazard_pointers::current;
+    hazard_pointers::scan();
+    if (!r->retired_list.empty())
+    {
+      std::lock_guard<std::mutex> lg(orphans_lock);
+      for (const hazard_pointers::retired &entry : r->retired_list)
+        orphans.emplace_back(entry.p, entry.release);
+    }
+    r->retired_list = {};
+    hazard_pointers::current = nullptr;
+    r->in_use.store(false, std::memory_order_release);
+  }
+};
+
+hazard_pointers::record * hazard_pointers::current_record()
+{
+  if (current != nullptr)
+    return current;
+  for (record *r = records.load(std::memory_order_acquire); r != nullptr; r = r->next)
+  {
+    if (!r->in_use.load(std::memory_order_relaxed) && !r->in_use.exchange(true, std::memory_order_acquire))
+    {
+      current = r;
+      break;
+    }
+  }
+  if (current == nullptr)
+  {
+    current = new record;
+    current->next = records.load(std::memory_order_relaxed);
+    while (!records.compare_exchange_weak(current->next, current, std::memory_order_release, std::memory_order_relaxed))
+    {
+    }
+    n_records.fetch_add(1, std::memory_order_relaxed);
+  }
+  static thread_local hazard_exit exit;
+  return current;
+}
+
+hazard_pointers::slot * hazard_pointers::acquire_slot()
+{
+  record *r = current_record();
+  for (size_t i = 0; i < slots_per_thread; i++)
+  {
+    if (!r->taken[i].load(std::memory_order_acquire))
+    {
+      r->taken[i].store(true, std::memory_order_relaxed);
+      return &r->slots[i];
+    }
+  }
+  throw std::length_error("hazard_pointers: all slots of the thread are taken");
+}
+
+hazard_pointers::record * hazard_pointers::owner_of(const slot *s) noexcept
+{
+  auto holds = [s](const record *r) {
+    return !std::less<const slot *>()(s, r->slots) && std::less<const slot *>()(s, r->slots + slots_per_thread);
+  };
+  if (current != nullptr && holds(current))
+    return current;
+  record *r = records.load(std::memory_order_acquire);
+  while (!holds(r))
+    r = r->next;
+  return r;
+}
+
+void hazard_pointers::release_slot(slot *s) noexcept
+{
+  record *r = owner_of(s);
+  s->store(nullptr, std::memory_order_release);
+  r->taken[s - r->slots].store(false, std::memory_order_release);
+}
+
+void hazard_pointers::retire(void *p, void (*release)(void *) noexcept)
+{
+  record *r = current_record();
+  r->retired_list.push_back({p, release});
+  if (r->retired_list.size() >= std::max(retire_threshold, 2 * slots_per_thread * n_records.load(std::memory_order_relaxed)))
+    scan();
+}
+
+size_t hazard_pointers::scan()
+{
+  record *r = current_record();
+  std::vector<retired> candidates;
+  candidates.swap(r->retired_list);
+  {
+    std::lock_guard<std::mutex> lg(orphans_lock);
+    for (const auto &orphan : orphans)
+      candidates.push_back({orphan.first, orphan.second});
+    orphans.clear();
+  }
+
+  std::vector<const void *> protected_list;
+  protected_list.reserve(slots_per_thread * n_records.load(std::memory_order_relaxed));
+  for (record *other = records.load(std::memory_order_acquire); other != nullptr; other = other->next)
+  {
+    for (const slot &s : other->slots)
+    {
+      if (const void *p = s.load(std::memory_order_seq_cst))
+        protected_list.push_back(p);
+    }
+  }
+  std::sort(protected_list.begin(), protected_list.end());
+
+  // Releases may retire more, into the emptied list
+  std::vector<retired> kept;
+  for (const retired &entry : candidates)
+  {
+    if (std::binary_search(protected_list.begin(), protected_list.end(), static_cast<const void *>(entry.p)))
+      kept.push_back(entry);
+    else
+      entry.release(entry.p);
+  }
+  r->retired_list.insert(r->retired_list.end(), kept.begin(), kept.end());
+  return r->retired_list.size();
+}
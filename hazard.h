@@ -0,0 +1,229 @@
+#ifndef HAZARD_H_
+#define HAZARD_H_
+
+#include <atomic>
+#include <cstddef>
+#include <type_traits>
+#include <vector>
+#include "shared_ptr.h"
+
+// Hazard pointers. A thread publishes the address it is about to read
+// through in one of its slots; a retired address is only released once
+// no slot holds it. Unlike epochs, a stalled reader only holds back the
+// few addresses in its own slots, so at most about
+// 2 * slots_per_thread * threads + retire_threshold are ever waiting
+struct hazard_pointers
+{
+  static constexpr size_t slots_per_thread = 4;
+  static constexpr size_t retire_threshold = 64;
+
+  using slot = std::atomic<const void *>;
+
+  // Takes a free slot of the calling thread.
+  // Throws std::length_error if all of them are taken
+  static slot * acquire_slot();
+  // Gives the slot back to the thread it was taken from, from any thread
+  static void release_slot(slot *s) noexcept;
+
+  // Calls release(p) once no slot holds p
+  static void retire(void *p, void (*release)(void *) noexcept);
+
+  // Releases the addresses retired by this thread that no slot holds now
+  // and returns how many are still waiting
+  static size_t scan();
+
+private:
+  friend struct hazard_exit;
+
+  struct retired
+  {
+    void *p;
+    void (*release)(void *) noexcept;
+  };
+
+  // Per thread, reused after the thread finishes
+  struct alignas(64) record
+  {
+    slot slots[slots_per_thread] = {};
+    // Set by the owner only, cleared by whoever releases the slot
+    std::atomic<bool> taken[slots_per_thread] = {};
+    std::vector<retired> retired_list;
+    std::atomic<bool> in_use{true};
+    record *next = nullptr;
+  };
+
+  static record * current_record();
+  static record * owner_of(const slot *s) noexcept;
+
+  // Every record made, never freed
+  static std::atomic<record *> records;
+  static std::atomic<size_t> n_records;
+  static inline thread_local record *current = nullptr;
+};
+
+template<typename T, class Policy>
+struct hazard_ptr;
+
+// Holds a shared_ptr that threads can read through without touching its
+// counts, see hazard_ptr. A replaced value is released once no hazard_ptr
+// protects it. As with atomic_shared_ptr only the control block is stored,
+// and aliased or converted pointers get a block of their own
+template<typename T, class Policy = default_policy>
+struct hazard_cell
+{
+  static_assert(Policy::is_thread_safe, "the counting policy must be thread-safe");
+
+  hazard_cell() noexcept = default;
+  hazard_cell(shared_ptr<T, Policy> desired);
+
+  hazard_cell(const hazard_cell &) = delete;
+  hazard_cell & operator=(const hazard_cell &) = delete;
+
+  ~hazard_cell();
+
+  void store(shared_ptr<T, Policy> desired);
+
+  // Shares ownership of the stored value
+  shared_ptr<T, Policy> load() const;
+
+private:
+  friend struct hazard_ptr<T, Policy>;
+
+  using element_type = std::remove_extent_t<T>;
+
+  std::atomic<control_block<Policy> *> cblock{nullptr};
+
+  // Takes the reference of p
+  static control_block<Policy> * release(shared_ptr<T, Policy> p);
+  static void retire(control_block<Policy> *cblock);
+
+  static void del_ref(void *cblock) noexcept
+  {
+    static_cast<control_block<Policy> *>(cblock)->del_ref();
+  }
+};
+
+// Protects the value of a hazard_cell from being released while it is
+// read, with no count updates. share() makes a shared_ptr when the value
+// is needed past the read. A thread has hazard_pointers::slots_per_thread
+// of these at most
+template<typename T, class Policy = default_policy>
+struct hazard_ptr
+{
+  using element_type = std::remove_extent_t<T>;
+
+  explicit hazard_ptr(const hazard_cell<T, Policy> &cell);
+
+  hazard_ptr(const hazard_ptr &) = delete;
+  hazard_ptr & operator=(const hazard_ptr &) = delete;
+
+  ~hazard_ptr()
+  {
+    hazard_pointers::release_slot(slot);
+  }
+
+  element_type * get() const noexcept
+  {
+    return ptr;
+  }
+
+  element_type & operator*() const noexcept
+  {
+    return *ptr;
+  }
+
+  element_type * operator->() const noexcept
+  {
+    return ptr;
+  }
+
+  explicit operator bool() const noexcept
+  {
+    return ptr != nullptr;
+  }
+
+  shared_ptr<T, Policy> share() const noexcept
+  {
+    // The cell's reference is not dropped while the block is protected
+    return shared_ptr<T, Policy>(cblock, ptr);
+  }
+
+private:
+  hazard_pointers::slot *slot;
+  control_block<Policy> *cblock;
+  element_type *ptr = nullptr;
+};
+
+template<typename T, class Policy>
+control_block<Policy> * hazard_cell<T, Policy>::release(shared_ptr<T, Policy> p)
+{
+  control_block<Policy> *cblock = p.cblock;
+  if (cblock != nullptr && static_cast<const volatile void *>(p.ptr) != cblock->object())
+  {
+    element_type *ptr = p.ptr;
+    cblock = new regular_control_block<element_type, policy_bridge_deleter<T, Policy>, Policy>(
+        ptr, policy_bridge_deleter<T, Policy>{std::move(p)});
+  }
+  else
+  {
+    p.cblock = nullptr;
+    p.ptr = nullptr;
+  }
+  return cblock;
+}
+
+template<typename T, class Policy>
+void hazard_cell<T, Policy>::retire(control_block<Policy> *cblock)
+{
+  if (cblock != nullptr)
+    hazard_pointers::retire(cblock, &del_ref);
+}
+
+template<typename T, class Policy>
+hazard_cell<T, Policy>::hazard_cell(shared_ptr<T, Policy> desired) : cblock(release(std::move(desired)))
+{
+}
+
+template<typename T, class Policy>
+hazard_cell<T, Policy>::~hazard_cell()
+{
+  // hazard_ptrs made from the cell may outlive it. This thread may not
+  // retire anything again, so the value is not left on its list
+  if (control_block<Policy> *last = cblock.load(std::memory_order_relaxed))
+  {
+    retire(last);
+    hazard_pointers::scan();
+  }
+}
+
+template<typename T, class Policy>
+void hazard_cell<T, Policy>::store(shared_ptr<T, Policy> desired)
+{
+  retire(cblock.exchange(release(std::move(desired)), std::memory_order_seq_cst));
+}
+
+template<typename T, class Policy>
+shared_ptr<T, Policy> hazard_cell<T, Policy>::load() const
+{
+  return hazard_ptr<T, Policy>(*this).share();
+}
+
+template<typename T, class Policy>
+hazard_ptr<T, Policy>::hazard_ptr(const hazard_cell<T, Policy> &cell) :
+    slot(hazard_pointers::acquire_slot()), cblock(cell.cblock.load(std::memory_order_relaxed))
+{
+  // The slot is only good once the cell is seen to still hold the block
+  // after the slot was set; the scan reads the slots after the exchange
+  for (;;)
+  {
+    slot->store(cblock, std::memory_order_seq_cst);
+    control_block<Policy> *again = cell.cblock.load(std::memory_order_seq_cst);
+    if (again == cblock)
+      break;
+    cblock = again;
+  }
+  if (cblock != nullptr)
+    ptr = static_cast<element_type *>(cblock->object());
+}
+
+#endif /* HAZARD_H_ */
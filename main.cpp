@@ -1,7 +1,20 @@
 #include <gtest/gtest.h>
 #include "shared_ptr.h"
+#include "compact_shared_ptr.h"
+#include "compact_weak_ptr.h"
+#include "atomic_shared_ptr.h"
+#include "deferred_release.h"
+#include "destruction_queue.h"
+#include "epoch.h"
+#include "hazard.h"
+#include "snapshot_cell.h"
+#include "reaper.h"
 #include "weak_ptr.h"
 #include "test_object.h"
+#include <cstring>
+#include <memory_resource>
+#include <thread>
+#include <vector>
 
 template <typename T>
 struct custom_deleter
@@ -20,6 +33,66 @@ private:
     bool* deleted;
 };
 
+template <typename T>
+struct counting_allocator
+{
+    using value_type = T;
+
+    explicit counting_allocator(int* live)
+        : live(live)
+    {}
+
+    template <typename U>
+    counting_allocator(counting_allocator<U> const& other)
+        : live(other.live)
+    {}
+
+    T* allocate(size_t n)
+    {
+        ++*live;
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T* p, size_t n)
+    {
+        --*live;
+        std::allocator<T>().deallocate(p, n);
+    }
+
+    int* live;
+};
+
+template <typename T, typename U>
+bool operator==(counting_allocator<T> const& a, counting_allocator<U> const& b)
+{
+    return a.live == b.live;
+}
+
+template <typename T, typename U>
+bool operator!=(counting_allocator<T> const& a, counting_allocator<U> const& b)
+{
+    return !(a == b);
+}
+
+struct throws_third
+{
+    throws_third()
+    {
+        if (live == 2)
+            throw std::runtime_error("third");
+        live++;
+    }
+
+    ~throws_third()
+    {
+        live--;
+    }
+
+    static int live;
+};
+
+int throws_third::live;
+
 struct base
 {};
 
@@ -567,6 +640,1389 @@ TEST(shared_ptr_testing, conversions_inheritance)
     EXPECT_EQ(d.get(), b.get());
 }
 
+TEST(shared_ptr_testing, concurrent_copies)
+{
+    bool deleted = false;
+    {
+        shared_ptr<derived> p(new derived(&deleted));
+        std::vector<std::thread> threads;
+        for (int i = 0; i < 4; i++)
+            threads.emplace_back([p] {
+                for (int j = 0; j < 100000; j++)
+                {
+                    shared_ptr<derived> q = p;
+                    shared_ptr<derived> r = std::move(q);
+                }
+            });
+        for (auto &t : threads)
+            t.join();
+        EXPECT_EQ(1, p.use_count());
+        EXPECT_FALSE(deleted);
+    }
+    EXPECT_TRUE(deleted);
+}
+
+TEST(shared_ptr_testing, concurrent_last_release)
+{
+    for (int i = 0; i < 1000; i++)
+    {
+        bool deleted = false;
+        shared_ptr<derived> p(new derived(&deleted));
+        weak_ptr<derived> w = p;
+        std::thread t([q = p]() mutable { q.reset(); });
+        p.reset();
+        t.join();
+        EXPECT_TRUE(deleted);
+        EXPECT_FALSE(static_cast<bool>(w.lock()));
+    }
+}
+
+TEST(shared_ptr_testing, weak_ptr_lock_concurrent_expiry)
+{
+    for (int i = 0; i < 1000; i++)
+    {
+        shared_ptr<test_object> p = make_shared<test_object>(42);
+        weak_ptr<test_object> w = p;
+        std::thread t([&w] {
+            while (shared_ptr<test_object> q = w.lock())
+                EXPECT_EQ(42, *q);
+        });
+        p.reset();
+        t.join();
+        EXPECT_FALSE(static_cast<bool>(w.lock()));
+    }
+}
+
+TEST(shared_ptr_testing, atomic_shared_ptr)
+{
+    test_object::no_new_instances_guard g;
+    {
+        atomic_shared_ptr<test_object> a(make_shared<test_object>(42));
+        EXPECT_TRUE(a.is_lock_free());
+        shared_ptr<test_object> p = a.load();
+        EXPECT_EQ(42, static_cast<int>(*p));
+
+        shared_ptr<test_object> q = a.exchange(make_shared<test_object>(43));
+        EXPECT_TRUE(p == q);
+        p.reset();
+        q.reset();
+        EXPECT_EQ(43, static_cast<int>(*a.load()));
+
+        a.store(nullptr);
+        g.expect_no_instances();
+        EXPECT_FALSE(static_cast<bool>(a.load()));
+        a = make_shared<test_object>(44);
+    }
+    g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, atomic_shared_ptr_many_loads)
+{
+    test_object::no_new_instances_guard g;
+    atomic_shared_ptr<test_object> a(make_shared<test_object>(42));
+    std::vector<shared_ptr<test_object>> held;
+    for (size_t i = 0; i < 100'000; i++)
+    {
+        shared_ptr<test_object> p = a.load();
+        EXPECT_EQ(42, static_cast<int>(*p));
+        if (i % 2 == 0)
+            held.push_back(std::move(p));
+    }
+    a.store(nullptr);
+    EXPECT_EQ(held.size(), held[0].use_count());
+    held.clear();
+    g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, atomic_shared_ptr_aliased)
+{
+    struct pair
+    {
+        int first, second;
+    };
+    shared_ptr<pair> p = make_shared<pair>(pair{1, 2});
+    atomic_shared_ptr<int> a(shared_ptr<int>(p, &p->second));
+    shared_ptr<int> q = a.load();
+    EXPECT_EQ(&p->second, q.get());
+    a.store(nullptr);
+    EXPECT_EQ(2, p.use_count());
+    q.reset();
+    EXPECT_EQ(1, p.use_count());
+}
+
+TEST(shared_ptr_testing, atomic_shared_ptr_reserve_counted)
+{
+    shared_ptr<int> p = make_shared<int>(42);
+    atomic_shared_ptr<int> a(p);
+    shared_ptr<int> q = a.load();
+    // The unclaimed reserve of the stored word counts
+    EXPECT_LE((split_ref_word<default_policy, false>::batch), p.use_count());
+    EXPECT_FALSE(p.wait_for_release(2, std::chrono::milliseconds(1)));
+    std::thread releaser([&] { a.store(nullptr); });
+    EXPECT_TRUE(p.wait_for_release(2, std::chrono::seconds(10)));
+    releaser.join();
+    EXPECT_EQ(2u, p.use_count());
+}
+
+TEST(shared_ptr_testing, atomic_shared_ptr_compare_exchange)
+{
+    test_object::no_new_instances_guard g;
+    {
+        shared_ptr<test_object> p = make_shared<test_object>(42);
+        shared_ptr<test_object> q = make_shared<test_object>(43);
+        atomic_shared_ptr<test_object> a(p);
+
+        shared_ptr<test_object> expected = q;
+        EXPECT_FALSE(a.compare_exchange_strong(expected, make_shared<test_object>(44)));
+        EXPECT_TRUE(expected == p);
+        EXPECT_TRUE(a.compare_exchange_strong(expected, q));
+        EXPECT_TRUE(a.load() == q);
+
+        shared_ptr<test_object> empty;
+        EXPECT_FALSE(a.compare_exchange_weak(empty, p));
+        EXPECT_TRUE(empty == q);
+    }
+    g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, atomic_shared_ptr_concurrent)
+{
+    atomic_shared_ptr<int> a(make_shared<int>(0));
+    std::atomic<bool> done{false};
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 4; i++)
+        readers.emplace_back([&] {
+            int last = 0;
+            while (!done.load())
+            {
+                shared_ptr<int> p = a.load();
+                EXPECT_LE(last, *p);
+                last = *p;
+            }
+        });
+    for (int i = 1; i <= 10'000; i++)
+    {
+        if (i % 2 == 0)
+            a.store(make_shared<int>(i));
+        else
+        {
+            shared_ptr<int> expected = a.load();
+            EXPECT_TRUE(a.compare_exchange_strong(expected, make_shared<int>(i)));
+        }
+    }
+    done = true;
+    for (auto &t : readers)
+        t.join();
+    EXPECT_EQ(10'000, *a.load());
+}
+
+TEST(shared_ptr_testing, atomic_shared_ptr_wait)
+{
+    shared_ptr<int> first = make_shared<int>(1);
+    atomic_shared_ptr<int> cell(first);
+    cell.wait(make_shared<int>(1));
+    std::atomic<bool> woken{false};
+    std::thread waiter([&] {
+        cell.wait(first);
+        woken = true;
+        EXPECT_EQ(2, *cell.load());
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    EXPECT_FALSE(woken);
+    cell.store(make_shared<int>(2));
+    cell.notify_all();
+    waiter.join();
+    EXPECT_TRUE(woken);
+}
+
+TEST(shared_ptr_testing, wait_until_unique)
+{
+    shared_ptr<int> p = make_shared<int>(42);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; i++)
+        threads.emplace_back([copy = p]() mutable {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            copy.reset();
+        });
+    p.wait_until_unique();
+    EXPECT_EQ(1u, p.use_count());
+    for (auto &t : threads)
+        t.join();
+}
+
+TEST(shared_ptr_testing, wait_for_release_timeout)
+{
+    shared_ptr<int> p = make_shared<int>(42);
+    shared_ptr<int> q = p;
+    EXPECT_FALSE(p.wait_for_release(1, std::chrono::milliseconds(5)));
+    EXPECT_TRUE(p.wait_for_release(2, std::chrono::milliseconds(5)));
+    std::thread releaser([&] { q.reset(); });
+    EXPECT_TRUE(p.wait_for_release(1, std::chrono::seconds(10)));
+    releaser.join();
+    EXPECT_TRUE(shared_ptr<int>().wait_for_release(0, std::chrono::nanoseconds(0)));
+}
+
+template <class Policy>
+void expect_woken_by_release()
+{
+    shared_ptr<int, Policy> p = make_shared<int, Policy>(42), q = p;
+    std::thread releaser([&q] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        q.reset();
+    });
+    EXPECT_TRUE(p.wait_for_release(1, std::chrono::seconds(10)));
+    releaser.join();
+    EXPECT_EQ(1u, p.use_count());
+    // The waiter is no longer counted
+    q = p;
+    EXPECT_EQ(2u, p.use_count());
+}
+
+TEST(shared_ptr_testing, wait_for_release_policies)
+{
+    expect_woken_by_release<atomic_policy>();
+    expect_woken_by_release<compact_atomic_policy>();
+    expect_woken_by_release<no_weak_policy<atomic_policy>>();
+    expect_woken_by_release<sharded_policy>();
+    expect_woken_by_release<deferred_policy<atomic_policy>>();
+}
+
+TEST(shared_ptr_testing, atomic_weak_ptr)
+{
+    test_object::no_new_instances_guard g;
+    shared_ptr<test_object> p = make_shared<test_object>(42);
+    atomic_weak_ptr<test_object> a(p);
+    EXPECT_TRUE(a.load().lock() == p);
+
+    shared_ptr<test_object> q(new test_object(43));
+    weak_ptr<test_object> old = a.exchange(q);
+    EXPECT_TRUE(old.lock() == p);
+    weak_ptr<test_object> expected = q;
+    EXPECT_TRUE(a.compare_exchange_strong(expected, p));
+
+    shared_ptr<int> alias(p, nullptr);
+    EXPECT_THROW(atomic_weak_ptr<int>{alias}, std::invalid_argument);
+    alias.reset();
+
+    p.reset();
+    q.reset();
+    g.expect_no_instances();
+    EXPECT_FALSE(static_cast<bool>(a.load().lock()));
+}
+
+TEST(shared_ptr_testing, biased_policy)
+{
+    test_object::no_new_instances_guard g;
+    shared_ptr<test_object, biased_policy> p = make_shared<test_object, biased_policy>(42);
+    shared_ptr<test_object, biased_policy> q = p;
+    EXPECT_EQ(2, p.use_count());
+    q.reset();
+    EXPECT_EQ(1, p.use_count());
+    p.reset();
+    g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, biased_policy_released_on_other_thread)
+{
+    bool deleted = false;
+    shared_ptr<derived, biased_policy> p(new derived(&deleted));
+    shared_ptr<derived, biased_policy> q = p;
+    std::thread([r = std::move(q)]() mutable {
+        shared_ptr<derived, biased_policy> s = r;
+        EXPECT_EQ(3, s.use_count());
+        s.reset();
+        r.reset();
+    }).join();
+    EXPECT_FALSE(deleted);
+    EXPECT_EQ(1, p.use_count());
+
+    // The other thread's release waits for the owner to merge it
+    std::thread([r = std::move(p)]() mutable { r.reset(); }).join();
+    EXPECT_FALSE(deleted);
+    biased_policy::merge_pending();
+    EXPECT_TRUE(deleted);
+
+    // Merged when the owner releases one of its references, to any block
+    deleted = false;
+    shared_ptr<int, biased_policy> other = make_shared<int, biased_policy>(1), copy = other;
+    p = shared_ptr<derived, biased_policy>(new derived(&deleted));
+    std::thread([r = std::move(p)]() mutable { r.reset(); }).join();
+    EXPECT_FALSE(deleted);
+    copy.reset();
+    EXPECT_TRUE(deleted);
+
+    // Released past the owner's count, then by the owner
+    deleted = false;
+    p = shared_ptr<derived, biased_policy>(new derived(&deleted));
+    q = p;
+    std::thread([r = std::move(q)]() mutable { r.reset(); }).join();
+    p.reset();
+    EXPECT_TRUE(deleted);
+}
+
+TEST(shared_ptr_testing, biased_policy_owner_finished)
+{
+    bool deleted = false;
+    shared_ptr<derived, biased_policy> p;
+    std::thread([&] {
+        p = shared_ptr<derived, biased_policy>(new derived(&deleted));
+        shared_ptr<derived, biased_policy> q = p;
+    }).join();
+    EXPECT_EQ(1, p.use_count());
+    p.reset();
+    EXPECT_TRUE(deleted);
+
+    // Released on other threads while the owner is still running
+    deleted = false;
+    std::thread([&] {
+        p = shared_ptr<derived, biased_policy>(new derived(&deleted));
+        std::thread([r = std::move(p)]() mutable { r.reset(); }).join();
+        EXPECT_FALSE(deleted);
+    }).join();
+    EXPECT_TRUE(deleted);
+}
+
+TEST(shared_ptr_testing, biased_policy_batched_release)
+{
+    // The owner releases the batch another thread reserved on store
+    bool deleted = false;
+    {
+        shared_ptr<derived, biased_policy> p(new derived(&deleted));
+        atomic_shared_ptr<derived, biased_policy> a;
+        std::thread([&] { a.store(p); }).join();
+    }
+    EXPECT_TRUE(deleted);
+
+    // The owner flushes its reference and one taken on another thread at once
+    using deferred_biased = deferred_policy<biased_policy>;
+    deleted = false;
+    shared_ptr<derived, deferred_biased> p(new derived(&deleted)), q;
+    std::thread([&] { q = p; }).join();
+    {
+        deferred_release_scope<deferred_biased> scope;
+        p.reset();
+        q.reset();
+        EXPECT_FALSE(deleted);
+    }
+    EXPECT_TRUE(deleted);
+}
+
+TEST(shared_ptr_testing, biased_policy_concurrent)
+{
+    for (int i = 0; i < 100; i++)
+    {
+        shared_ptr<int, biased_policy> p = make_shared<int, biased_policy>(42);
+        std::vector<std::thread> threads;
+        for (int j = 0; j < 4; j++)
+            threads.emplace_back([q = p]() {
+                for (int k = 0; k < 1000; k++)
+                {
+                    shared_ptr<int, biased_policy> r = q;
+                    EXPECT_EQ(42, *r);
+                }
+            });
+        for (int k = 0; k < 1000; k++)
+        {
+            shared_ptr<int, biased_policy> r = p;
+            EXPECT_EQ(42, *r);
+        }
+        p.reset();
+        for (auto &t : threads)
+            t.join();
+        biased_policy::merge_pending();
+    }
+}
+
+TEST(shared_ptr_testing, sharded_policy)
+{
+    test_object::no_new_instances_guard g;
+    shared_ptr<test_object, sharded_policy> p = make_shared<test_object, sharded_policy>(42);
+    weak_ptr<test_object, sharded_policy> w = p;
+    {
+        std::vector<shared_ptr<test_object, sharded_policy>> copies(10, p);
+        std::thread([&copies] { copies.resize(5); }).join();
+    }
+    EXPECT_EQ(42, static_cast<int>(*w.lock()));
+    EXPECT_EQ(1u, p.use_count());
+    shared_ptr<test_object, sharded_policy> q = p;
+    EXPECT_EQ(2u, q.use_count());
+    q.reset();
+    p.reset();
+    g.expect_no_instances();
+    EXPECT_FALSE(static_cast<bool>(w.lock()));
+}
+
+TEST(shared_ptr_testing, sharded_policy_released_without_kill)
+{
+    bool deleted = false;
+    {
+        shared_ptr<derived, sharded_policy> p(new derived(&deleted));
+        shared_ptr<derived, sharded_policy> q = p;
+    }
+    EXPECT_TRUE(deleted);
+    // The last reference held on a shard, released on another thread
+    for (int i = 0; i < 20; i++)
+    {
+        deleted = false;
+        shared_ptr<derived, sharded_policy> p(new derived(&deleted));
+        std::vector<shared_ptr<derived, sharded_policy>> copies(i, p);
+        EXPECT_EQ(size_t(i) + 1, p.use_count());
+        std::thread([&copies] { copies.clear(); }).join();
+        shared_ptr<derived, sharded_policy> q = p;
+        EXPECT_EQ(2u, p.use_count());
+        p.reset();
+        std::thread([q = std::move(q)]() mutable { q.reset(); }).join();
+        EXPECT_TRUE(deleted);
+    }
+}
+
+TEST(shared_ptr_testing, sharded_policy_kill_concurrent)
+{
+    for (int i = 0; i < 20; i++)
+    {
+        bool deleted = false;
+        shared_ptr<derived, sharded_policy> p(new derived(&deleted));
+        std::atomic<bool> go{false};
+        std::vector<std::thread> threads;
+        for (int j = 0; j < 4; j++)
+            threads.emplace_back([q = p, &go]() mutable {
+                while (!go.load())
+                    std::this_thread::yield();
+                for (int k = 0; k < 10'000; k++)
+                {
+                    shared_ptr<derived, sharded_policy> r = q;
+                    r.reset();
+                }
+            });
+        go = true;
+        kill_shards(p);
+        p.reset();
+        for (auto &t : threads)
+            t.join();
+        EXPECT_TRUE(deleted);
+    }
+}
+
+using deferred = deferred_policy<atomic_policy>;
+
+TEST(shared_ptr_testing, deferred_release_scope)
+{
+    bool deleted = false;
+    {
+        deferred_release_scope<deferred> scope;
+        shared_ptr<derived, deferred> p(new derived(&deleted));
+        weak_ptr<derived, deferred> w = p;
+        std::vector<shared_ptr<derived, deferred>> copies(1000, p);
+        copies.clear();
+        EXPECT_EQ(1001, p.use_count());
+        p.reset();
+        EXPECT_FALSE(deleted);
+        EXPECT_TRUE(static_cast<bool>(w.lock()));
+    }
+    EXPECT_TRUE(deleted);
+}
+
+TEST(shared_ptr_testing, deferred_release_scope_overflow)
+{
+    bool deleted[1000] = {};
+    {
+        deferred_release_scope<deferred> scope;
+        std::vector<shared_ptr<derived, deferred>> v;
+        for (bool &d : deleted)
+            v.emplace_back(new derived(&d));
+        {
+            deferred_release_scope<deferred> nested;
+            v.clear();
+        }
+        // Only the blocks that did not fit are released
+        size_t n_deleted = std::count(std::begin(deleted), std::end(deleted), true);
+        EXPECT_LT(0u, n_deleted);
+        EXPECT_GT(1000u, n_deleted);
+    }
+    EXPECT_EQ(1000, std::count(std::begin(deleted), std::end(deleted), true));
+}
+
+TEST(shared_ptr_testing, deferred_release_scope_cascade)
+{
+    struct node
+    {
+        shared_ptr<node, deferred> next;
+    };
+    {
+        deferred_release_scope<deferred> scope;
+        shared_ptr<node, deferred> head = make_shared<node, deferred>();
+        weak_ptr<node, deferred> tail = head;
+        for (int i = 0; i < 100; i++)
+            head = make_shared<node, deferred>(node{head});
+        head.reset();
+        EXPECT_TRUE(static_cast<bool>(tail.lock()));
+    }
+    // Blocks of other policies are released right away
+    bool deleted = false;
+    {
+        deferred_release_scope<deferred> scope;
+        shared_ptr<derived> p(new derived(&deleted));
+        p.reset();
+        EXPECT_TRUE(deleted);
+    }
+}
+
+TEST(shared_ptr_testing, reaper_delete)
+{
+    struct on_thread
+    {
+        explicit on_thread(std::thread::id* id)
+            : id(id)
+        {}
+
+        ~on_thread()
+        {
+            *id = std::this_thread::get_id();
+        }
+
+        std::thread::id* id;
+    };
+    std::thread::id id;
+    shared_ptr<on_thread> p = make_reaped<on_thread>(&id);
+    weak_ptr<on_thread> w = p;
+    p.reset();
+    EXPECT_FALSE(static_cast<bool>(w.lock()));
+    reaper::flush();
+    EXPECT_NE(std::thread::id(), id);
+    EXPECT_NE(std::this_thread::get_id(), id);
+
+    bool deleted = false;
+    shared_ptr<derived>(new derived(&deleted), reaper_delete<derived, custom_deleter<derived>>(custom_deleter<derived>(&deleted)));
+    reaper::flush();
+    EXPECT_TRUE(deleted);
+}
+
+TEST(shared_ptr_testing, reaper_flush_waits_for_cascade)
+{
+    struct node
+    {
+        explicit node(shared_ptr<node> next, bool* deleted)
+            : next(std::move(next)), deleted(deleted)
+        {}
+
+        ~node()
+        {
+            *deleted = true;
+        }
+
+        shared_ptr<node> next;
+        bool* deleted;
+    };
+    bool deleted[100] = {};
+    shared_ptr<node> head;
+    for (bool &d : deleted)
+        head = make_reaped<node>(head, &d);
+    head.reset();
+    reaper::flush();
+    EXPECT_EQ(100, std::count(std::begin(deleted), std::end(deleted), true));
+}
+
+TEST(shared_ptr_testing, destruction_queue_drain)
+{
+    bool deleted[10] = {};
+    {
+        destruction_queue queue;
+        for (bool &d : deleted)
+            shared_ptr<derived>(new derived(&d), queued_delete<derived>(queue));
+        EXPECT_EQ(0, std::count(std::begin(deleted), std::end(deleted), true));
+        EXPECT_EQ(3u, queue.drain(3));
+        EXPECT_TRUE(deleted[0] && deleted[1] && deleted[2] && !deleted[3]);
+        EXPECT_EQ(1u, queue.drain(3, std::chrono::microseconds(0)));
+        EXPECT_TRUE(deleted[3] && !deleted[4]);
+        EXPECT_EQ(0u, queue.drain(0));
+        EXPECT_FALSE(queue.empty());
+    }
+    EXPECT_EQ(10, std::count(std::begin(deleted), std::end(deleted), true));
+}
+
+TEST(shared_ptr_testing, destruction_queue_cascade)
+{
+    struct node
+    {
+        shared_ptr<node> next;
+    };
+    destruction_queue queue;
+    shared_ptr<node> head;
+    weak_ptr<node> tail;
+    for (int i = 0; i < 100; i++)
+    {
+        head = shared_ptr<node>(new node{head}, queued_delete<node>(queue));
+        if (i == 0)
+            tail = head;
+    }
+    head.reset();
+    // Each destructor only queues the next node
+    for (int i = 0; i < 9; i++)
+        EXPECT_EQ(10u, queue.drain(10));
+    EXPECT_TRUE(static_cast<bool>(tail.lock()));
+    EXPECT_EQ(10u, queue.drain_all());
+    EXPECT_FALSE(static_cast<bool>(tail.lock()));
+    EXPECT_TRUE(queue.empty());
+}
+
+TEST(shared_ptr_testing, epoch_delete)
+{
+    bool deleted = false;
+    {
+        epoch_guard guard;
+        shared_ptr<derived> p = make_epoch_reclaimed<derived>(&deleted);
+        derived* raw = p.get();
+        p.reset();
+        EXPECT_FALSE(deleted);
+        EXPECT_NE(nullptr, raw);
+    }
+    epoch::flush();
+    EXPECT_TRUE(deleted);
+}
+
+TEST(shared_ptr_testing, epoch_delete_without_flush)
+{
+    // Retired by a thread that finishes
+    bool deleted = false;
+    std::thread([&] { make_epoch_reclaimed<derived>(&deleted); }).join();
+    EXPECT_TRUE(deleted);
+
+    // Retired by a thread that goes on reading, and retires nothing more
+    deleted = false;
+    make_epoch_reclaimed<derived>(&deleted);
+    for (int i = 0; i < 1000 && !deleted; i++)
+        epoch_guard guard;
+    EXPECT_TRUE(deleted);
+}
+
+TEST(shared_ptr_testing, epoch_delete_waits_for_readers)
+{
+    bool deleted[1000] = {};
+    std::atomic<bool> pinned{false}, done{false};
+    std::thread reader([&] {
+        epoch_guard guard;
+        pinned = true;
+        while (!done)
+            std::this_thread::yield();
+    });
+    while (!pinned)
+        std::this_thread::yield();
+    for (bool &d : deleted)
+        make_epoch_reclaimed<derived>(&d);
+    EXPECT_EQ(0, std::count(std::begin(deleted), std::end(deleted), true));
+    done = true;
+    reader.join();
+    epoch::flush();
+    EXPECT_EQ(1000, std::count(std::begin(deleted), std::end(deleted), true));
+}
+
+TEST(shared_ptr_testing, epoch_delete_concurrent_reads)
+{
+    struct value
+    {
+        explicit value(int x)
+            : x(x)
+        {}
+
+        ~value()
+        {
+            x = -1;
+        }
+
+        int x;
+    };
+    shared_ptr<value> owner = make_epoch_reclaimed<value>(0);
+    std::atomic<value*> published{owner.get()};
+    std::atomic<bool> done{false};
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 4; i++)
+        readers.emplace_back([&] {
+            while (!done)
+            {
+                epoch_guard guard;
+                EXPECT_LE(0, published.load(std::memory_order_acquire)->x);
+            }
+        });
+    for (int i = 1; i <= 10000; i++)
+    {
+        shared_ptr<value> next = make_epoch_reclaimed<value>(i);
+        published.store(next.get(), std::memory_order_release);
+        owner = std::move(next);
+    }
+    done = true;
+    for (auto &t : readers)
+        t.join();
+    owner.reset();
+    epoch::flush();
+}
+
+TEST(shared_ptr_testing, hazard_ptr)
+{
+    bool deleted = false, next_deleted = false;
+    hazard_cell<derived> cell(shared_ptr<derived>(new derived(&deleted)));
+    {
+        hazard_ptr<derived> h(cell);
+        derived* raw = h.get();
+        cell.store(make_shared<derived>(&next_deleted));
+        EXPECT_EQ(raw, h.get());
+        hazard_pointers::scan();
+        EXPECT_FALSE(deleted);
+        shared_ptr<derived> kept = h.share();
+        EXPECT_EQ(raw, kept.get());
+        EXPECT_EQ(2, kept.use_count());
+    }
+    hazard_pointers::scan();
+    EXPECT_TRUE(deleted);
+    EXPECT_FALSE(next_deleted);
+    cell.store(nullptr);
+    hazard_pointers::scan();
+    EXPECT_TRUE(next_deleted);
+
+    hazard_cell<int> empty;
+    hazard_ptr<int> h(empty);
+    EXPECT_FALSE(static_cast<bool>(h));
+    EXPECT_FALSE(static_cast<bool>(empty.load()));
+}
+
+TEST(shared_ptr_testing, hazard_ptr_slots_run_out)
+{
+    hazard_cell<int> cell(make_shared<int>(42));
+    std::vector<std::unique_ptr<hazard_ptr<int>>> held;
+    for (size_t i = 0; i < hazard_pointers::slots_per_thread; i++)
+        held.emplace_back(new hazard_ptr<int>(cell));
+    EXPECT_THROW(hazard_ptr<int> h(cell), std::length_error);
+    held.pop_back();
+    hazard_ptr<int> h(cell);
+    EXPECT_EQ(42, *h);
+}
+
+TEST(shared_ptr_testing, hazard_ptr_released_on_other_thread)
+{
+    hazard_cell<int> cell(make_shared<int>(42));
+    std::unique_ptr<hazard_ptr<int>> h(new hazard_ptr<int>(cell));
+    // Gives the slot back to this thread
+    std::thread([&h] { h.reset(); }).join();
+    std::vector<std::unique_ptr<hazard_ptr<int>>> held;
+    for (size_t i = 0; i < hazard_pointers::slots_per_thread; i++)
+        held.emplace_back(new hazard_ptr<int>(cell));
+    EXPECT_EQ(42, *held.back()->share());
+}
+
+TEST(shared_ptr_testing, hazard_cell_destroyed)
+{
+    bool deleted = false;
+    {
+        hazard_cell<derived> cell(shared_ptr<derived>(new derived(&deleted)));
+    }
+    // Not left for a later scan of this thread
+    EXPECT_TRUE(deleted);
+}
+
+TEST(shared_ptr_testing, hazard_ptr_bounded_with_stalled_reader)
+{
+    bool deleted[1000] = {};
+    hazard_cell<derived> cell(shared_ptr<derived>(new derived(&deleted[0])));
+    std::atomic<bool> pinned{false}, done{false};
+    std::thread reader([&] {
+        hazard_ptr<derived> h(cell);
+        pinned = true;
+        while (!done)
+            std::this_thread::yield();
+    });
+    while (!pinned)
+        std::this_thread::yield();
+    for (size_t i = 1; i < 1000; i++)
+        cell.store(shared_ptr<derived>(new derived(&deleted[i])));
+    // Only the value the reader protects is held back, besides the ones
+    // not scanned yet
+    EXPECT_EQ(1u, hazard_pointers::scan());
+    EXPECT_FALSE(deleted[0]);
+    EXPECT_EQ(998, std::count(std::begin(deleted), std::end(deleted), true));
+    done = true;
+    reader.join();
+    cell.store(nullptr);
+    hazard_pointers::scan();
+    EXPECT_EQ(1000, std::count(std::begin(deleted), std::end(deleted), true));
+}
+
+TEST(shared_ptr_testing, hazard_ptr_concurrent_reads)
+{
+    struct value
+    {
+        explicit value(int x)
+            : x(x)
+        {}
+
+        ~value()
+        {
+            x = -1;
+        }
+
+        int x;
+    };
+    hazard_cell<value> cell(make_shared<value>(0));
+    std::atomic<bool> done{false};
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 4; i++)
+        readers.emplace_back([&] {
+            while (!done)
+            {
+                hazard_ptr<value> h(cell);
+                EXPECT_LE(0, h->x);
+                if (h->x % 16 == 0)
+                {
+                    EXPECT_LE(0, h.share()->x);
+                }
+            }
+        });
+    for (int i = 1; i <= 10000; i++)
+        cell.store(make_shared<value>(i));
+    done = true;
+    for (auto &t : readers)
+        t.join();
+}
+
+TEST(shared_ptr_testing, snapshot_cell)
+{
+    bool deleted = false;
+    snapshot_cell<derived> cell(shared_ptr<derived>(new derived(&deleted)));
+    shared_ptr<derived> first = cell.load();
+    derived* raw = first.get();
+    EXPECT_EQ(raw, cell.read().get());
+    size_t count = first.use_count();
+    for (int i = 0; i < 10; i++)
+        EXPECT_EQ(raw, cell.read().get());
+    EXPECT_EQ(count, first.use_count());
+    first.reset();
+
+    bool next_deleted = false;
+    cell.publish(make_shared<derived>(&next_deleted));
+    EXPECT_EQ(2u, cell.version());
+    // Dropped from this thread's cache by the publication
+    EXPECT_TRUE(deleted);
+    {
+        snapshot_guard<derived> guard = cell.read();
+        EXPECT_NE(raw, guard.get());
+        EXPECT_EQ(2u, guard.version());
+    }
+    cell.publish(nullptr);
+    EXPECT_FALSE(static_cast<bool>(cell.read()));
+    EXPECT_TRUE(next_deleted);
+}
+
+TEST(shared_ptr_testing, snapshot_cell_stale_entries_dropped)
+{
+    // Cached by another thread, which goes on reading other cells
+    shared_ptr<int> old = make_shared<int>(1);
+    snapshot_cell<int> cell(old), other(make_shared<int>(0));
+    std::atomic<int> step{0};
+    std::thread reader([&] {
+        EXPECT_EQ(1, *cell.read());
+        step = 1;
+        while (step != 2)
+            EXPECT_EQ(0, *other.read());
+    });
+    while (step != 1)
+        std::this_thread::yield();
+    cell.publish(make_shared<int>(2));
+    EXPECT_TRUE(old.wait_for_release(1, std::chrono::seconds(10)));
+    step = 2;
+    reader.join();
+
+    // Cached by this thread, then the cell goes
+    bool deleted = false;
+    {
+        snapshot_cell<derived> gone(shared_ptr<derived>(new derived(&deleted)));
+        gone.read();
+    }
+    EXPECT_TRUE(deleted);
+}
+
+TEST(shared_ptr_testing, snapshot_cell_guard_keeps_value)
+{
+    snapshot_cell<int> cell(make_shared<int>(1));
+    snapshot_guard<int> outer = cell.read();
+    cell.publish(make_shared<int>(2));
+    EXPECT_EQ(1, *cell.read());
+    EXPECT_EQ(2, *cell.load());
+    EXPECT_EQ(1, *outer);
+
+    // Cells whose entries collide while one of them is guarded
+    std::vector<std::unique_ptr<snapshot_cell<int>>> cells;
+    for (int i = 0; i < 17; i++)
+        cells.emplace_back(new snapshot_cell<int>(make_shared<int>(i)));
+    snapshot_guard<int> first = cells[0]->read();
+    EXPECT_EQ(16, *cells[16]->read());
+    EXPECT_EQ(0, *first);
+}
+
+TEST(shared_ptr_testing, snapshot_cell_wait)
+{
+    snapshot_cell<int> cell(make_shared<int>(1));
+    uint64_t version = cell.version();
+    EXPECT_FALSE(cell.wait_for(version, std::chrono::milliseconds(1)));
+    std::thread waiter([&] {
+        cell.wait(version);
+        EXPECT_EQ(2, *cell.read());
+    });
+    cell.publish(make_shared<int>(2));
+    waiter.join();
+    EXPECT_TRUE(cell.wait_for(version, std::chrono::milliseconds(1)));
+}
+
+TEST(shared_ptr_testing, snapshot_cell_concurrent_reads)
+{
+    snapshot_cell<const int> cell(make_shared<const int>(0));
+    std::atomic<bool> done{false};
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 4; i++)
+        readers.emplace_back([&] {
+            int last = 0;
+            while (!done)
+            {
+                snapshot_guard<const int> guard = cell.read();
+                EXPECT_LE(last, *guard);
+                last = *guard;
+            }
+        });
+    for (int i = 1; i <= 10000; i++)
+        cell.publish(make_shared<const int>(i));
+    done = true;
+    for (auto &t : readers)
+        t.join();
+    EXPECT_EQ(10000, *cell.read());
+}
+
+TEST(shared_ptr_testing, single_threaded_policy)
+{
+    test_object::no_new_instances_guard g;
+    shared_ptr<test_object, single_threaded_policy> p(new test_object(42));
+    shared_ptr<test_object, single_threaded_policy> q = p;
+    EXPECT_EQ(2, p.use_count());
+    weak_ptr<test_object, single_threaded_policy> w = q;
+    q.reset();
+    EXPECT_EQ(42, *w.lock());
+    p.reset();
+    g.expect_no_instances();
+    EXPECT_FALSE(static_cast<bool>(w.lock()));
+}
+
+TEST(shared_ptr_testing, single_threaded_policy_make_shared)
+{
+    test_object::no_new_instances_guard g;
+    auto p = make_shared<test_object, single_threaded_policy>(42);
+    EXPECT_EQ(42, *p);
+    EXPECT_EQ(1, p.use_count());
+}
+
+TEST(shared_ptr_testing, compact_atomic_policy)
+{
+    static_assert(sizeof(inplace_control_block<int, compact_atomic_policy>) <
+                  sizeof(inplace_control_block<int, atomic_policy>));
+    test_object::no_new_instances_guard g;
+    auto p = make_shared<test_object, compact_atomic_policy>(42);
+    weak_ptr<test_object, compact_atomic_policy> w = p;
+    {
+        shared_ptr<test_object, compact_atomic_policy> q = w.lock();
+        EXPECT_EQ(2, p.use_count());
+        EXPECT_EQ(42, *q);
+    }
+    p.reset();
+    g.expect_no_instances();
+    EXPECT_FALSE(static_cast<bool>(w.lock()));
+}
+
+TEST(shared_ptr_testing, compact_atomic_policy_concurrent)
+{
+    bool deleted = false;
+    {
+        shared_ptr<derived, compact_atomic_policy> p(new derived(&deleted));
+        weak_ptr<derived, compact_atomic_policy> w = p;
+        std::vector<std::thread> threads;
+        for (int i = 0; i < 4; i++)
+            threads.emplace_back([p, w] {
+                for (int j = 0; j < 100000; j++)
+                {
+                    shared_ptr<derived, compact_atomic_policy> q = w.lock();
+                    weak_ptr<derived, compact_atomic_policy> v = q;
+                }
+            });
+        for (auto &t : threads)
+            t.join();
+        EXPECT_EQ(1, p.use_count());
+    }
+    EXPECT_TRUE(deleted);
+}
+
+TEST(shared_ptr_testing, no_weak_policy)
+{
+    static_assert(sizeof(inplace_control_block<int, no_weak_policy<atomic_policy>>) <
+                  sizeof(inplace_control_block<int, atomic_policy>));
+    test_object::no_new_instances_guard g;
+    auto p = make_shared<test_object, no_weak_policy<atomic_policy>>(42);
+    shared_ptr<test_object, no_weak_policy<atomic_policy>> q = p;
+    EXPECT_EQ(2, q.use_count());
+    p.reset();
+    EXPECT_EQ(42, *q);
+}
+
+TEST(shared_ptr_testing, no_weak_policy_custom_deleter)
+{
+    bool deleted = false;
+    {
+        shared_ptr<test_object, no_weak_policy<single_threaded_policy>> p(
+            new test_object(42), custom_deleter<test_object>(&deleted));
+    }
+    EXPECT_TRUE(deleted);
+}
+
+// Policy the library does not ship
+struct user_policy : basic_refcount_policy<plain_counter>
+{
+    static constexpr bool is_thread_safe = false;
+};
+
+TEST(shared_ptr_testing, user_defined_policy)
+{
+    test_object::no_new_instances_guard g;
+    shared_ptr<test_object, user_policy> p = make_shared<test_object, user_policy>(42);
+    weak_ptr<test_object, user_policy> w = p;
+    EXPECT_EQ(42, *w.lock());
+    p.reset();
+    g.expect_no_instances();
+    EXPECT_FALSE(static_cast<bool>(w.lock()));
+
+    shared_ptr<int, no_weak_policy<user_policy>> q(new int(42));
+    EXPECT_EQ(42, *q);
+}
+
+TEST(shared_ptr_testing, pool_release_on_other_thread)
+{
+    test_object::no_new_instances_guard g;
+    std::vector<shared_ptr<test_object>> v;
+    for (int i = 0; i < 10000; i++)
+        v.push_back(make_shared<test_object>(i));
+    std::thread([v = std::move(v)]() mutable { v.clear(); }).join();
+    g.expect_no_instances();
+    for (int i = 0; i < 10000; i++)
+        v.push_back(make_shared<test_object>(i));
+    for (int i = 0; i < 10000; i++)
+        EXPECT_EQ(i, *v[i]);
+}
+
+TEST(shared_ptr_testing, pool_over_aligned_and_large)
+{
+    struct alignas(64) aligned
+    {
+        char data[64];
+    };
+    struct large
+    {
+        char data[1024];
+    };
+    shared_ptr<aligned> p = make_shared<aligned>();
+    EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(p.get()) % alignof(aligned));
+    shared_ptr<large> q = make_shared<large>();
+    q->data[1023] = 1;
+    EXPECT_EQ(1, q->data[1023]);
+}
+
+TEST(shared_ptr_testing, allocate_shared)
+{
+    test_object::no_new_instances_guard g;
+    int live = 0;
+    weak_ptr<test_object> w;
+    {
+        shared_ptr<test_object> p = allocate_shared<test_object>(counting_allocator<int>(&live), 42);
+        EXPECT_EQ(42, *p);
+        EXPECT_EQ(1, live);
+        w = p;
+    }
+    g.expect_no_instances();
+    EXPECT_EQ(1, live);
+    w.reset();
+    EXPECT_EQ(0, live);
+}
+
+TEST(shared_ptr_testing, allocate_shared_empty_allocator)
+{
+    EXPECT_EQ(sizeof(inplace_control_block<int, atomic_policy>),
+              (sizeof(allocated_control_block<int, std::allocator<int>, atomic_policy>)));
+    shared_ptr<int> p = ::allocate_shared<int>(std::allocator<int>(), 42);
+    EXPECT_EQ(42, *p);
+}
+
+TEST(shared_ptr_testing, allocate_shared_memory_resource)
+{
+    test_object::no_new_instances_guard g;
+    char buffer[1024];
+    std::pmr::monotonic_buffer_resource arena(buffer, sizeof(buffer), std::pmr::null_memory_resource());
+    {
+        shared_ptr<test_object> p = ::allocate_shared<test_object>(&arena, 42);
+        shared_ptr<std::pmr::string> s = ::allocate_shared<std::pmr::string>(&arena, "long enough to allocate");
+        EXPECT_EQ(42, *p);
+        EXPECT_TRUE(reinterpret_cast<char*>(p.get()) >= buffer && reinterpret_cast<char*>(p.get()) < buffer + sizeof(buffer));
+        EXPECT_TRUE(s->data() >= buffer && s->data() < buffer + sizeof(buffer));
+    }
+    g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, array_ptr_ctor)
+{
+    test_object::no_new_instances_guard g;
+    shared_ptr<test_object[]> p(new test_object[3]{1, 2, 3});
+    EXPECT_EQ(2, p[1]);
+    shared_ptr<test_object const[]> q = p;
+    EXPECT_EQ(3, q[2]);
+}
+
+TEST(shared_ptr_testing, make_shared_array)
+{
+    test_object::no_new_instances_guard g;
+    shared_ptr<test_object[]> p = make_shared<test_object[]>(5, test_object(7));
+    for (int i = 0; i < 5; i++)
+        EXPECT_EQ(7, p[i]);
+    weak_ptr<test_object[]> w = p;
+    p.reset();
+    g.expect_no_instances();
+    EXPECT_FALSE(static_cast<bool>(w.lock()));
+}
+
+TEST(shared_ptr_testing, make_shared_array_value_initialized)
+{
+    shared_ptr<int[]> p = make_shared<int[]>(1000);
+    for (int i = 0; i < 1000; i++)
+        EXPECT_EQ(0, p[i]);
+    shared_ptr<double[4]> q = make_shared<double[4]>(1.5);
+    EXPECT_EQ(1.5, q[3]);
+    shared_ptr<int[]> empty = make_shared<int[]>(0);
+    EXPECT_TRUE(static_cast<bool>(empty));
+}
+
+TEST(shared_ptr_testing, make_shared_array_over_aligned)
+{
+    struct alignas(64) aligned
+    {
+        char data[8];
+    };
+    shared_ptr<aligned[]> p = make_shared<aligned[]>(3);
+    EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(&p[0]) % 64);
+}
+
+TEST(shared_ptr_testing, make_shared_array_throwing_element)
+{
+    throws_third::live = 0;
+    EXPECT_THROW(make_shared<throws_third[]>(5), std::runtime_error);
+    EXPECT_EQ(0, throws_third::live);
+}
+
+TEST(shared_ptr_testing, make_shared_array_size_overflow)
+{
+    EXPECT_THROW(make_shared<int[]>(SIZE_MAX / 2, 7), std::bad_array_new_length);
+    EXPECT_THROW((make_shared<int[], no_weak_policy<atomic_policy>>(SIZE_MAX / 4)), std::bad_array_new_length);
+    EXPECT_THROW((make_shared_for_overwrite<int[], no_weak_policy<atomic_policy>>(SIZE_MAX - 1)),
+                 std::bad_array_new_length);
+}
+
+TEST(shared_ptr_testing, make_shared_for_overwrite)
+{
+    test_object::no_new_instances_guard g;
+    struct buffer
+    {
+        size_t size;
+        char data[4096];
+    };
+    shared_ptr<buffer> p = make_shared_for_overwrite<buffer>();
+    p->size = 3;
+    std::memcpy(p->data, "abc", 3);
+    EXPECT_EQ(0, std::memcmp(p->data, "abc", 3));
+
+    shared_ptr<int[]> q = make_shared_for_overwrite<int[]>(100);
+    q[99] = 5;
+    EXPECT_EQ(5, q[99]);
+    shared_ptr<int[8]> r = make_shared_for_overwrite<int[8]>();
+    r[7] = 6;
+    EXPECT_EQ(6, r[7]);
+
+    // Class types are still constructed
+    shared_ptr<std::string[]> s = make_shared_for_overwrite<std::string[]>(3);
+    EXPECT_TRUE(s[2].empty());
+}
+
+struct large_object : test_object
+{
+    large_object(int data) : test_object(data) {}
+
+    // Counts storage of its own, which make_shared in place would not use
+    static void* operator new(size_t size)
+    {
+        ++allocated;
+        return ::operator new(size);
+    }
+
+    static void operator delete(void* p, size_t size)
+    {
+        --allocated;
+        ::operator delete(p, size);
+    }
+
+    static int allocated;
+    char padding[split_storage_threshold];
+};
+
+int large_object::allocated = 0;
+
+TEST(shared_ptr_testing, make_shared_split_storage)
+{
+    test_object::no_new_instances_guard g;
+    shared_ptr<large_object> p = make_shared<large_object>(42);
+    weak_ptr<large_object> q = p;
+    EXPECT_EQ(42, static_cast<int>(*p));
+    EXPECT_EQ(1, large_object::allocated);
+    p.reset();
+    g.expect_no_instances();
+    // The storage goes with the object, while the weak_ptr still holds the block
+    EXPECT_EQ(0, large_object::allocated);
+    EXPECT_FALSE(static_cast<bool>(q.lock()));
+
+    shared_ptr<test_object> r = make_shared_split<test_object>(43);
+    weak_ptr<test_object> s = r;
+    EXPECT_TRUE(s.lock() == r);
+    r.reset();
+    g.expect_no_instances();
+    EXPECT_FALSE(static_cast<bool>(s.lock()));
+}
+
+TEST(shared_ptr_testing, make_shared_split_arrays)
+{
+    shared_ptr<int[]> p = make_shared<int[]>(split_storage_threshold);
+    EXPECT_EQ(0, p[split_storage_threshold - 1]);
+    shared_ptr<int[]> q = make_shared_split<int[]>(10);
+    EXPECT_EQ(0, q[9]);
+    shared_ptr<int[4]> r = make_shared_split<int[4]>();
+    EXPECT_EQ(0, r[3]);
+    shared_ptr<char[]> s = make_shared_for_overwrite<char[]>(split_storage_threshold);
+    s[0] = 'a';
+    EXPECT_EQ('a', s[0]);
+}
+
+TEST(shared_ptr_testing, compact_shared_ptr)
+{
+    test_object::no_new_instances_guard g;
+    static_assert(sizeof(compact_shared_ptr<test_object>) == sizeof(void *));
+    compact_shared_ptr<test_object> p = make_compact_shared<test_object>(42);
+    EXPECT_EQ(42, static_cast<int>(*p));
+    EXPECT_EQ(1u, p.use_count());
+    compact_shared_ptr<test_object> q = p;
+    EXPECT_EQ(p.get(), q.get());
+    EXPECT_EQ(2u, p.use_count());
+
+    shared_ptr<test_object> r = q;
+    EXPECT_EQ(p.get(), r.get());
+    EXPECT_EQ(3u, r.use_count());
+    shared_ptr<test_object> s = std::move(q);
+    EXPECT_FALSE(static_cast<bool>(q));
+    EXPECT_EQ(3u, s.use_count());
+    weak_ptr<test_object> w = s;
+
+    p.reset();
+    r.reset();
+    s.reset();
+    g.expect_no_instances();
+    EXPECT_FALSE(static_cast<bool>(w.lock()));
+}
+
+TEST(shared_ptr_testing, compact_shared_ptr_to_base)
+{
+    bool deleted = false;
+    {
+        compact_shared_ptr<derived> p = make_compact_shared<derived>(&deleted);
+        shared_ptr<base> q = p;
+        EXPECT_EQ(static_cast<base *>(p.get()), q.get());
+        std::vector<compact_shared_ptr<derived>> v(3, p);
+        v.erase(v.begin());
+        EXPECT_EQ(4u, q.use_count());
+    }
+    EXPECT_TRUE(deleted);
+}
+
+TEST(shared_ptr_testing, compact_weak_ptr)
+{
+    test_object::no_new_instances_guard g;
+    static_assert(sizeof(compact_weak_ptr<test_object>) == sizeof(void *));
+    shared_ptr<test_object> p = make_shared<test_object>(42);
+    compact_weak_ptr<test_object> q = p;
+    compact_weak_ptr<test_object> r = q;
+    EXPECT_TRUE(r.lock() == p);
+
+    shared_ptr<test_object> s(new test_object(43));
+    compact_weak_ptr<test_object> t = s;
+    EXPECT_TRUE(t.lock() == s);
+
+    compact_shared_ptr<test_object> u = make_compact_shared<test_object>(44);
+    compact_weak_ptr<test_object> v = u;
+    EXPECT_EQ(u.get(), v.lock().get());
+
+    p.reset();
+    s.reset();
+    u.reset();
+    g.expect_no_instances();
+    EXPECT_FALSE(static_cast<bool>(q.lock()));
+    EXPECT_FALSE(static_cast<bool>(r.lock()));
+    EXPECT_FALSE(static_cast<bool>(t.lock()));
+    EXPECT_FALSE(static_cast<bool>(v.lock()));
+}
+
+TEST(shared_ptr_testing, compact_weak_ptr_aliased)
+{
+    struct pair
+    {
+        int first, second;
+    };
+    shared_ptr<pair> p = make_shared<pair>(pair{1, 2});
+    shared_ptr<int> second(p, &p->second);
+    compact_weak_ptr<int> q = second;
+    compact_weak_ptr<int> r = q;
+    q.reset();
+    EXPECT_EQ(&p->second, r.lock().get());
+
+    shared_ptr<int[]> arr = make_shared<int[]>(4);
+    shared_ptr<int[]> tail(arr, &arr[2]);
+    compact_weak_ptr<int[]> s = arr, t = tail;
+    EXPECT_EQ(&arr[0], s.lock().get());
+    EXPECT_EQ(&arr[2], t.lock().get());
+
+    p.reset();
+    second.reset();
+    EXPECT_FALSE(static_cast<bool>(r.lock()));
+}
+
+TEST(shared_ptr_testing, policy_conversion)
+{
+    test_object::no_new_instances_guard g;
+    shared_ptr<test_object, single_threaded_policy> p(new test_object(42));
+    {
+        shared_ptr<test_object, atomic_policy> q(p);
+        shared_ptr<test_object, atomic_policy> r = q;
+        EXPECT_TRUE(p == q);
+        EXPECT_EQ(2, p.use_count());
+        EXPECT_EQ(2, q.use_count());
+        p.reset();
+        EXPECT_EQ(42, *r);
+    }
+    g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, policy_conversion_is_explicit)
+{
+    EXPECT_FALSE((std::is_convertible_v<shared_ptr<test_object, single_threaded_policy>,
+                                        shared_ptr<test_object, atomic_policy>>));
+    EXPECT_TRUE((std::is_constructible_v<shared_ptr<test_object, atomic_policy>,
+                                         shared_ptr<test_object, single_threaded_policy>>));
+    EXPECT_FALSE((std::is_constructible_v<shared_ptr<derived, atomic_policy>,
+                                          shared_ptr<base, single_threaded_policy>>));
+}
+
 int main(int argc, char** argv)
 {
     testing::InitGoogleTest(&argc, argv);
@@ -0,0 +1,120 @@
+#include "reaper.h"
+#include <condition_variable>
+#include <mutex>
+#include <system_error>
+#include <thread>
+
+namespace
+{
+  struct reaper_thread
+  {
+    reaper_thread()
+    {
+      try
+      {
+        worker = std::thread([this] { run(); });
+      }
+      catch (const std::system_error &)
+      {
+      }
+    }
+
+    ~reaper_thread()
+    {
+      if (worker.joinable())
+      {
+        {
+          std::lock_guard<std::mutex> lock(m);
+          stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
+      }
+      joined.store(true, std::memory_order_relaxed);
+    }
+
+    void run() noexcept
+    {
+      for (;;)
+      {
+        retired_object *list = queue.take_all();
+        if (list == nullptr)
+        {
+          std::unique_lock<std::mutex> lock(m);
+          idle.notify_all();
+          wake.wait(lock, [this] { return !queue.empty() || stopping; });
+          if (queue.empty())
+            return;
+          continue;
+        }
+        while (list != nullptr)
+        {
+          retired_object *next = list->next;
+          list->destroy(list);
+          destroyed.fetch_add(1, std::memory_order_release);
+          list = next;
+        }
+      }
+    }
+
+    void push(retired_object *r) noexcept
+    {
+      retired.fetch_add(1, std::memory_order_relaxed);
+      // The reaper checks the queue under the lock before it sleeps
+      if (queue.push(r))
+      {
+        std::lock_guard<std::mutex> lock(m);
+        wake.notify_one();
+      }
+    }
+
+    void flush()
+    {
+      std::unique_lock<std::mutex> lock(m);
+      idle.wait(lock, [this] {
+        return destroyed.load(std::memory_order_acquire) == retired.load(std::memory_order_relaxed);
+      });
+    }
+
+    retired_stack queue;
+    std::atomic<size_t> retired{0}, destroyed{0};
+    std::mutex m;
+    std::condition_variable wake, idle;
+    bool stopping = false;
+    std::thread worker;
+
+    // Set once the thread is gone, for objects released later during exit
+    static std::atomic<bool> joined;
+  };
+
+  std::atomic<bool> reaper_thread::joined{false};
+
+  reaper_thread * instance() noexcept
+  {
+    if (reaper_thread::joined.load(std::memory_order_relaxed))
+      return nullptr;
+    try
+    {
+      static reaper_thread thread;
+      return thread.worker.joinable() ? &thread : nullptr;
+    }
+    catch (...)
+    {
+      return nullptr;
+    }
+  }
+}
+
+void reaper::retire(retired_object *r) noexcept
+{
+  if (reaper_thread *thread = instance())
+    thread->push(r);
+  else
+    r->destroy(r);
+}
+
+void reaper::flush()
+{
+  if (reaper_thread *thread = instance())
+    thread->flush();
+}
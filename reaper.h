@@ -0,0 +1,50 @@
+#ifndef REAPER_H_
+#define REAPER_H_
+
+#include <memory>
+#include <utility>
+#include "retired_object.h"
+#include "shared_ptr.h"
+
+// Background thread that destroys the objects given to it, so that the
+// thread dropping the last reference does not pay for a large teardown.
+// It starts with the first retired object and is joined at exit. The
+// objects are destroyed on the reaper thread, so they must only release
+// blocks of thread-safe policies
+struct reaper
+{
+  // Hands r to the reaper thread. If the thread cannot run (it failed to
+  // start or has been joined at exit), r is destroyed right away
+  static void retire(retired_object *r) noexcept;
+
+  // Waits until the reaper has destroyed everything retired so far,
+  // including whatever those objects released to it in turn
+  static void flush();
+};
+
+// Deleter that passes the object on to the reaper with its own deleter
+template<typename T, class Deleter = std::default_delete<T>>
+struct reaper_delete
+{
+  reaper_delete() = default;
+  explicit reaper_delete(Deleter d) : d(std::move(d)) {}
+
+  template<typename Y>
+  void operator()(Y *ptr) noexcept
+  {
+    if (retired_object *r = retire_call(ptr, d))
+      reaper::retire(r);
+  }
+
+  Deleter d;
+};
+
+// Creates a T that will be destroyed by the reaper. The object is kept
+// apart from its block, as the block may go before the object does
+template<typename T, class Policy = default_policy, typename ...Args>
+shared_ptr<T, Policy> make_reaped(Args&&... args)
+{
+  return shared_ptr<T, Policy>(new T(std::forward<Args>(args)...), reaper_delete<T>());
+}
+
+#endif /* REAPER_H_ */
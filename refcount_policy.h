@@ -0,0 +1,688 @@
+#ifndef REFCOUNT_POLICY_H_
+#define REFCOUNT_POLICY_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+// Counter for blocks that never leave one thread
+struct plain_counter
+{
+  explicit plain_counter(size_t value) noexcept : value(value) {}
+
+  void increment(size_t n = 1) noexcept
+  {
+    value += n;
+  }
+
+  // Returns true if the counter dropped to zero
+  bool decrement(size_t n = 1) noexcept
+  {
+    return (value -= n) == 0;
+  }
+
+  // Increments unless the counter is zero, returns whether it did
+  bool try_increment() noexcept
+  {
+    if (value == 0)
+      return false;
+    value++;
+    return true;
+  }
+
+  size_t load() const noexcept
+  {
+    return value;
+  }
+
+  // True if the caller holds the only count; for the last owner's fast paths
+  bool is_unique() const noexcept
+  {
+    return value == 1;
+  }
+
+private:
+  size_t value;
+};
+
+// Order of the decrements that may drop the last reference. Normally
+// release, with an acquire fence for the last owner only; ThreadSanitizer
+// does not understand standalone fences, so there every decrement acquires
+#if defined(__SANITIZE_THREAD__)
+#define REFCOUNT_POLICY_TSAN
+#elif defined(__has_feature)
+#if __has_feature(thread_sanitizer)
+#define REFCOUNT_POLICY_TSAN
+#endif
+#endif
+
+#ifdef REFCOUNT_POLICY_TSAN
+inline constexpr std::memory_order decrement_order = std::memory_order_acq_rel;
+#else
+inline constexpr std::memory_order decrement_order = std::memory_order_release;
+#endif
+
+// Counter for blocks shared between threads
+struct atomic_counter
+{
+  explicit atomic_counter(size_t value) noexcept : value(value) {}
+
+  void increment(size_t n = 1) noexcept
+  {
+    // A new reference is always made from an existing one,
+    // so there is nothing to synchronize with
+    value.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  bool decrement(size_t n = 1) noexcept
+  {
+    bool watched;
+    return decrement(n, watched);
+  }
+
+  // Also tells whether anyone waits for the count to drop, see add_waiter
+  bool decrement(size_t n, bool &watched) noexcept
+  {
+    size_t old = value.fetch_sub(n, decrement_order);
+    watched = old > count_mask;
+    if ((old & count_mask) == n)
+    {
+      // Only the last owner needs to see the other owners' writes
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return true;
+    }
+    return false;
+  }
+
+  bool try_increment() noexcept
+  {
+    size_t cur = value.load(std::memory_order_relaxed);
+    do
+    {
+      if ((cur & count_mask) == 0)
+        return false;
+    } while (!value.compare_exchange_weak(cur, cur + 1, std::memory_order_relaxed));
+    return true;
+  }
+
+  size_t load() const noexcept
+  {
+    return value.load(std::memory_order_relaxed) & count_mask;
+  }
+
+  // Threads waiting for the count to drop are counted above it, so that
+  // a decrement learns of them from the value it replaces, and a waiter
+  // that comes after a decrement sees the count it left
+  void add_waiter() noexcept
+  {
+    value.fetch_add(waiter_one, std::memory_order_relaxed);
+  }
+
+  void del_waiter() noexcept
+  {
+    value.fetch_sub(waiter_one, std::memory_order_relaxed);
+  }
+
+  bool is_unique() const noexcept
+  {
+    // Acquire pairs with the release decrements of the former holders
+    return value.load(std::memory_order_acquire) == 1;
+  }
+
+private:
+  static constexpr size_t waiter_one = size_t(1) << 48;
+  static constexpr size_t count_mask = waiter_one - 1;
+
+  std::atomic<size_t> value;
+};
+
+// Strong and weak counts of a control block.
+// All shared references together hold one weak reference,
+// so the block is freed by whoever drops the last weak one.
+// The counts of n references can be taken or dropped at once
+template<class Counter>
+struct basic_refcount_policy
+{
+  using counter_type = Counter;
+  static constexpr bool has_weak = true;
+
+  void add_ref(size_t n = 1) noexcept
+  {
+    n_shared_refs.increment(n);
+  }
+
+  bool del_ref(size_t n = 1) noexcept
+  {
+    return n_shared_refs.decrement(n);
+  }
+
+  // For counters that count waiters, see counts_waiters
+  bool del_ref(size_t n, bool &watched) noexcept
+  {
+    return n_shared_refs.decrement(n, watched);
+  }
+
+  void add_waiter() noexcept
+  {
+    n_shared_refs.add_waiter();
+  }
+
+  void del_waiter() noexcept
+  {
+    n_shared_refs.del_waiter();
+  }
+
+  // Used by weak references, which must not revive an expired object
+  bool try_add_ref() noexcept
+  {
+    return n_shared_refs.try_increment();
+  }
+
+  void add_weak(size_t n = 1) noexcept
+  {
+    n_weak_refs.increment(n);
+  }
+
+  bool del_weak(size_t n = 1) noexcept
+  {
+    return n_weak_refs.decrement(n);
+  }
+
+  // No weak references besides the one held by the shared ones.
+  // Once the strong count is zero this can no longer change
+  bool sole_weak() const noexcept
+  {
+    return n_weak_refs.is_unique();
+  }
+
+  size_t ref_count() const noexcept
+  {
+    return n_shared_refs.load();
+  }
+
+private:
+  Counter n_shared_refs{1}, n_weak_refs{1};
+};
+
+// No atomic operations; pointers must not be shared between threads
+struct single_threaded_policy : basic_refcount_policy<plain_counter>
+{
+  static constexpr bool is_thread_safe = false;
+};
+
+struct atomic_policy : basic_refcount_policy<atomic_counter>
+{
+  static constexpr bool is_thread_safe = true;
+};
+
+// Both counts packed into one word, so the control block header shrinks
+// by a word and a single load tells the last owner whether any weak
+// references remain. The strong count is limited to 2^32 - 1 and the weak
+// one to 2^24 - 1; the top byte of the weak half counts the threads waiting
+// for the strong count to drop, up to 255. Overflowing any of them terminates
+struct compact_atomic_policy
+{
+  static constexpr bool is_thread_safe = true;
+  static constexpr bool has_weak = true;
+
+  void add_ref(size_t n = 1) noexcept
+  {
+    check(counts.fetch_add(strong_one * n, std::memory_order_relaxed) >> 32, n, max_strong);
+  }
+
+  bool del_ref(size_t n = 1) noexcept
+  {
+    bool watched;
+    return del_ref(n, watched);
+  }
+
+  bool del_ref(size_t n, bool &watched) noexcept
+  {
+    uint64_t old = counts.fetch_sub(strong_one * n, decrement_order);
+    watched = (old & waiter_mask) != 0;
+    if ((old >> 32) == n)
+    {
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return true;
+    }
+    return false;
+  }
+
+  void add_waiter() noexcept
+  {
+    check((counts.fetch_add(waiter_one, std::memory_order_relaxed) & waiter_mask) / waiter_one, 1, max_waiters);
+  }
+
+  void del_waiter() noexcept
+  {
+    counts.fetch_sub(waiter_one, std::memory_order_relaxed);
+  }
+
+  bool try_add_ref() noexcept
+  {
+    uint64_t cur = counts.load(std::memory_order_relaxed);
+    do
+    {
+      if ((cur >> 32) == 0)
+        return false;
+      check(cur >> 32, 1, max_strong);
+    } while (!counts.compare_exchange_weak(cur, cur + strong_one, std::memory_order_relaxed));
+    return true;
+  }
+
+  void add_weak(size_t n = 1) noexcept
+  {
+    check(counts.fetch_add(n, std::memory_order_relaxed) & weak_mask, n, weak_mask);
+  }
+
+  bool del_weak(size_t n = 1) noexcept
+  {
+    if ((counts.fetch_sub(n, decrement_order) & weak_mask) == n)
+    {
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return true;
+    }
+    return false;
+  }
+
+  bool sole_weak() const noexcept
+  {
+    return (counts.load(std::memory_order_acquire) & weak_mask) == 1;
+  }
+
+  size_t ref_count() const noexcept
+  {
+    return counts.load(std::memory_order_relaxed) >> 32;
+  }
+
+private:
+  static constexpr uint64_t strong_one = uint64_t(1) << 32;
+  static constexpr uint64_t waiter_one = uint64_t(1) << 24;
+  static constexpr uint64_t weak_mask = waiter_one - 1;
+  static constexpr uint64_t waiter_mask = strong_one - waiter_one;
+  static constexpr uint64_t max_strong = strong_one - 1;
+  static constexpr uint64_t max_waiters = waiter_mask / waiter_one;
+
+  std::atomic<uint64_t> counts{strong_one | 1};
+
+  // Called with the value a count had before being incremented by n
+  static void check(uint64_t old, size_t n, uint64_t max) noexcept
+  {
+    if (old > max - n)
+      std::terminate();
+  }
+};
+
+// Strong count only, on the counter of Policy. The block is freed together
+// with the object, and weak_ptr cannot be formed for such pointers
+template<class Policy>
+struct no_weak_policy
+{
+  using counter_type = typename Policy::counter_type;
+  static constexpr bool is_thread_safe = Policy::is_thread_safe;
+  static constexpr bool has_weak = false;
+
+  void add_ref(size_t n = 1) noexcept
+  {
+    n_shared_refs.increment(n);
+  }
+
+  bool del_ref(size_t n = 1) noexcept
+  {
+    return n_shared_refs.decrement(n);
+  }
+
+  bool del_ref(size_t n, bool &watched) noexcept
+  {
+    return n_shared_refs.decrement(n, watched);
+  }
+
+  void add_waiter() noexcept
+  {
+    n_shared_refs.add_waiter();
+  }
+
+  void del_waiter() noexcept
+  {
+    n_shared_refs.del_waiter();
+  }
+
+  size_t ref_count() const noexcept
+  {
+    return n_shared_refs.load();
+  }
+
+private:
+  counter_type n_shared_refs{1};
+};
+
+// percpu_ref-style counts for objects copied on every thread: each thread
+// counts on one of a few shards, each in a cache line of its own. A thread
+// takes its releases off its own shard while the shard has counts to give,
+// and off the central count otherwise, so shards never go below zero and
+// the references are the sum of the shards plus the central count. The
+// central count holds a bias besides the first reference, so it does not
+// reach zero while the shards are live. A release that would take it down
+// to the bias (the last reference may be on a shard) first collapses the
+// shards into it, exactly once: each shard is swapped for a dead mark,
+// operations that find their shard dead go to the central count, and the
+// bias is dropped. From then on the block is counted exactly and released
+// with its last reference. kill_shards() collapses a block early, and so
+// does waiting for its count to drop
+struct sharded_policy
+{
+  static constexpr bool is_thread_safe = true;
+  static constexpr bool has_weak = true;
+  static constexpr size_t n_shards = 16;
+
+  void add_ref(size_t n = 1) noexcept
+  {
+    if (shard().fetch_add(int64_t(n), std::memory_order_relaxed) < dead_threshold)
+      central.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  bool del_ref(size_t n = 1) noexcept
+  {
+    bool watched;
+    return del_ref(n, watched);
+  }
+
+  bool del_ref(size_t n, bool &watched) noexcept
+  {
+    std::atomic<int64_t> &s = shard();
+    int64_t cur = s.load(std::memory_order_relaxed);
+    // A dead shard is negative, so this also sends those to the central count
+    while (cur >= int64_t(n))
+    {
+      if (s.compare_exchange_weak(cur, cur - int64_t(n), decrement_order, std::memory_order_relaxed))
+      {
+        // Waiters collapse the shards first
+        watched = false;
+        return false;
+      }
+    }
+    return del_central(n, watched);
+  }
+
+  bool try_add_ref() noexcept
+  {
+    // A live shard means the count cannot be zero
+    if (shard().fetch_add(1, std::memory_order_relaxed) >= dead_threshold)
+      return true;
+    size_t cur = central.load(std::memory_order_relaxed);
+    do
+    {
+      if ((cur & count_mask) == 0)
+        return false;
+    } while (!central.compare_exchange_weak(cur, cur + 1, std::memory_order_relaxed));
+    return true;
+  }
+
+  void add_weak(size_t n = 1) noexcept
+  {
+    n_weak_refs.increment(n);
+  }
+
+  bool del_weak(size_t n = 1) noexcept
+  {
+    return n_weak_refs.decrement(n);
+  }
+
+  bool sole_weak() const noexcept
+  {
+    return n_weak_refs.is_unique();
+  }
+
+  // Sums the shards while they are live, without collapsing them;
+  // as approximate as any count other threads are changing
+  size_t ref_count() const noexcept
+  {
+    size_t c = central.load(std::memory_order_relaxed);
+    if (c < bias)
+      return c & count_mask;
+    int64_t sum = int64_t(c - bias);
+    for (const padded_shard &s : shards)
+    {
+      int64_t count = s.count.load(std::memory_order_relaxed);
+      if (count >= dead_threshold)
+        sum += count;
+    }
+    return sum > 0 ? size_t(sum) : 0;
+  }
+
+  // Waiters are counted on the central count, which needs every release
+  // to go there
+  void add_waiter() noexcept
+  {
+    collapse();
+    central.fetch_add(waiter_one, std::memory_order_relaxed);
+  }
+
+  void del_waiter() noexcept
+  {
+    central.fetch_sub(waiter_one, std::memory_order_relaxed);
+  }
+
+  // Must be called with a reference held, so the count stays above zero
+  void collapse() const noexcept;
+
+private:
+  static constexpr int64_t dead = INT64_MIN / 2;
+  // Operations on a dead shard leave it far below this
+  static constexpr int64_t dead_threshold = INT64_MIN / 4;
+  // The central count is above the bias exactly while the shards are live
+  static constexpr size_t bias = size_t(1) << 62;
+  // Past the collapse, waiters are counted above the exact count
+  static constexpr size_t waiter_one = size_t(1) << 48;
+  static constexpr size_t count_mask = waiter_one - 1;
+
+  enum : int
+  {
+    live, collapsing, collapsed
+  };
+
+  struct alignas(64) padded_shard
+  {
+    std::atomic<int64_t> count{0};
+  };
+
+  mutable padded_shard shards[n_shards];
+  mutable std::atomic<size_t> central{bias + 1};
+  mutable std::atomic<int> state{live};
+  atomic_counter n_weak_refs{1};
+
+  static inline std::atomic<size_t> next_shard{0};
+
+  std::atomic<int64_t> & shard() noexcept
+  {
+    static thread_local size_t index = next_shard.fetch_add(1, std::memory_order_relaxed) % n_shards;
+    return shards[index].count;
+  }
+
+  // Only the value replaced is looked at once the reference is dropped,
+  // as any other release may free the block from then on
+  bool del_central(size_t n, bool &watched) noexcept
+  {
+    size_t cur = central.load(std::memory_order_relaxed);
+    while (cur > bias)
+    {
+      if (cur - n <= bias)
+      {
+        // The rest of the references, if any, are on the shards
+        collapse();
+        break;
+      }
+      if (central.compare_exchange_weak(cur, cur - n, decrement_order, std::memory_order_relaxed))
+      {
+        watched = false;
+        return false;
+      }
+    }
+    size_t old = central.fetch_sub(n, decrement_order);
+    watched = old > count_mask;
+    if ((old & count_mask) == n)
+    {
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return true;
+    }
+    return false;
+  }
+};
+
+inline void sharded_policy::collapse() const noexcept
+{
+  int expected = live;
+  if (state.compare_exchange_strong(expected, collapsing, std::memory_order_acquire))
+  {
+    for (padded_shard &s : shards)
+      central.fetch_add(size_t(s.count.exchange(dead, std::memory_order_acq_rel)), std::memory_order_relaxed);
+    // The caller's reference keeps the count above zero
+    central.fetch_sub(bias, decrement_order);
+    state.store(collapsed, std::memory_order_release);
+  }
+  else
+  {
+    while (state.load(std::memory_order_acquire) != collapsed)
+      std::this_thread::yield();
+  }
+}
+
+struct biased_policy;
+
+// Per-thread state of biased_policy. Kept after the thread finishes,
+// since blocks it made may still refer to it
+struct biased_thread_record
+{
+  // Blocks released on other threads past the owner's count,
+  // waiting for the owner to merge them
+  std::atomic<biased_policy *> pending{nullptr};
+  biased_thread_record *next_record = nullptr;
+
+  // Owner of merged blocks, which no thread is
+  static biased_thread_record none;
+};
+
+// Biased reference counting: the thread that made the block counts with
+// plain loads and stores, other threads use a separate atomic count.
+// When the owner's count drops to zero, the two counts are merged and
+// the block is counted atomically from then on. A block released on
+// other threads while the owner still counts references (the shared count
+// goes negative) is queued for its owner, which merges it on
+// merge_pending(), when it makes a new block, releases a reference to one
+// of its blocks or finishes; after the owner has finished, the releasing
+// thread merges it.
+// Strong references only
+struct biased_policy
+{
+  static constexpr bool is_thread_safe = true;
+  static constexpr bool has_weak = false;
+
+  biased_policy() noexcept : biased_policy(&release_block) {}
+
+  biased_policy(const biased_policy &) = delete;
+  biased_policy & operator=(const biased_policy &) = delete;
+
+  void add_ref(size_t n = 1) noexcept
+  {
+    if (owned())
+      biased.store(biased.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    else
+      shared.fetch_add(int64_t(n) * count_one, std::memory_order_relaxed);
+  }
+
+  bool del_ref(size_t n = 1) noexcept
+  {
+    if (owned())
+    {
+      size_t own = biased.load(std::memory_order_relaxed);
+      // Some of the references were taken on other threads, so the rest
+      // is released from the shared count once the two are merged
+      if (n > own)
+      {
+        biased.store(0, std::memory_order_relaxed);
+        merge_owned();
+        return del_shared(n - own);
+      }
+      size_t rest = own - n;
+      biased.store(rest, std::memory_order_relaxed);
+      if (rest == 0)
+        return merge_owned();
+      if (current->pending.load(std::memory_order_relaxed) != nullptr)
+        return merge_pending(this);
+      return false;
+    }
+    return del_shared(n);
+  }
+
+  size_t ref_count() const noexcept
+  {
+    return biased.load(std::memory_order_relaxed) + (shared.load(std::memory_order_relaxed) >> flag_bits);
+  }
+
+  // Merges the blocks made by this thread that are waiting for it
+  static void merge_pending() noexcept;
+
+protected:
+  using release_fn = void (*)(biased_policy *) noexcept;
+
+  // For policies that wrap this one: release is called with the counts
+  // of a block that has no references left, and releases that block
+  explicit biased_policy(release_fn release) noexcept;
+
+private:
+  // The shared count is kept above two flags
+  static constexpr int flag_bits = 2;
+  static constexpr int64_t merged = 1, queued = 2, count_one = 4;
+
+  biased_thread_record *const home;
+  // home until merged, none afterwards
+  std::atomic<biased_thread_record *> owner;
+  // Written by the owner only, atomic so that ref_count() can read it
+  std::atomic<size_t> biased;
+  std::atomic<int64_t> shared;
+  biased_policy *next_pending = nullptr;
+  // Blocks of every policy built on this one share the pending lists
+  const release_fn release;
+
+  static inline thread_local biased_thread_record *current = nullptr;
+
+  bool owned() const noexcept
+  {
+    return owner.load(std::memory_order_relaxed) == current;
+  }
+
+  static biased_thread_record * current_record() noexcept;
+  // Releases the blocks that have no references left after merging,
+  // except self, for which it returns whether it has none
+  static bool merge_list(biased_policy *list, const biased_policy *self = nullptr) noexcept;
+  static bool merge_pending(const biased_policy *self) noexcept;
+
+  bool merge_owned() noexcept;
+  bool del_shared(size_t n) noexcept;
+  void enqueue() noexcept;
+  // Returns true if no references are left
+  bool merge() noexcept;
+
+  // Releases the control_block<biased_policy> holding the counts
+  static void release_block(biased_policy *counts) noexcept;
+
+  friend struct biased_exit;
+};
+
+// Policies whose strong count also counts the threads waiting for it to
+// drop, with add_waiter() and del_waiter(), and whose del_ref(n, watched)
+// tells whether there are any. Only their blocks can be waited on
+template<class Policy, class = void>
+inline constexpr bool counts_waiters = false;
+
+template<class Policy>
+inline constexpr bool counts_waiters<Policy, std::void_t<decltype(std::declval<Policy &>().add_waiter())>> =
+    Policy::is_thread_safe;
+
+using default_policy = atomic_policy;
+
+#endif /* REFCOUNT_POLICY_H_ */
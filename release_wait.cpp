@@ -0,0 +1,11 @@
+#include "release_wait.h"
+
+namespace
+{
+  wait_word buckets[64];
+}
+
+wait_word & release_waiters::bucket(const void *cblock) noexcept
+{
+  return buckets[(reinterpret_cast<uintptr_t>(cblock) >> 4) * 0x9E3779B97F4A7C15ull >> 58];
+}
@@ -0,0 +1,45 @@
+#ifndef RELEASE_WAIT_H_
+#define RELEASE_WAIT_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include "futex.h"
+
+// Threads waiting for the strong count of a block to drop, sleeping on
+// one of a few futex words picked by block address. The waiters of a
+// block are counted in the word of its strong count (see counts_waiters),
+// so a release learns of them from its own decrement and notifies only
+// then. As the mark and the decrement change the same word, either the
+// release sees the mark or the waiter sees the count it left
+struct release_waiters
+{
+  static void notify(const void *cblock) noexcept
+  {
+    bucket(cblock).notify_all();
+  }
+
+  // Blocks until done() holds or the timeout passes, returns done()
+  template<class Pred>
+  static bool wait_for(const void *cblock, Pred done, std::chrono::nanoseconds timeout);
+
+private:
+  static wait_word & bucket(const void *cblock) noexcept;
+};
+
+template<class Pred>
+bool release_waiters::wait_for(const void *cblock, Pred done, std::chrono::nanoseconds timeout)
+{
+  using clock = std::chrono::steady_clock;
+  wait_word &word = bucket(cblock);
+  bool res = true;
+  if (timeout >= clock::time_point::max() - clock::now())
+    word.wait(done);
+  else
+    res = word.wait_for(done, timeout);
+  // What the releasers did with the object happens before the return
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return res;
+}
+
+#endif /* RELEASE_WAIT_H_ */
@@ -0,0 +1,90 @@
+#ifndef RETIRED_OBJECT_H_
+#define RETIRED_OBJECT_H_
+
+#include <atomic>
+#include <new>
+#include <utility>
+
+// Object whose destruction was put off, with the type erased
+struct retired_object
+{
+  void (*destroy)(retired_object *) noexcept;
+  retired_object *next = nullptr;
+};
+
+// Calls d(ptr) when destroyed
+template<typename T, class Deleter>
+struct retired_call final : retired_object
+{
+  retired_call(T *ptr, Deleter d) : retired_object{&run}, ptr(ptr), d(std::move(d)) {}
+
+  static void run(retired_object *r) noexcept
+  {
+    retired_call *call = static_cast<retired_call *>(r);
+    call->d(call->ptr);
+    delete call;
+  }
+
+  T *ptr;
+  Deleter d;
+};
+
+// Wraps d(ptr) for later. Without memory for that, calls it right away
+// and returns nullptr
+template<typename T, class Deleter>
+retired_object * retire_call(T *ptr, Deleter &d) noexcept
+{
+  retired_object *r = nullptr;
+  try
+  {
+    r = new(std::nothrow) retired_call<T, Deleter>(ptr, std::move(d));
+  }
+  catch (...)
+  {
+  }
+  if (r == nullptr)
+  {
+    d(ptr);
+  }
+  return r;
+}
+
+// Lock-free stack that many threads push to and one takes everything from
+struct retired_stack
+{
+  // Returns true if the stack was empty
+  bool push(retired_object *r) noexcept
+  {
+    // r belongs to the taker as soon as it is in
+    retired_object *old = head.load(std::memory_order_relaxed);
+    do
+    {
+      r->next = old;
+    } while (!head.compare_exchange_weak(old, r, std::memory_order_release, std::memory_order_relaxed));
+    return old == nullptr;
+  }
+
+  // Returns the objects oldest first
+  retired_object * take_all() noexcept
+  {
+    retired_object *list = head.exchange(nullptr, std::memory_order_acquire), *reversed = nullptr;
+    while (list != nullptr)
+    {
+      retired_object *next = list->next;
+      list->next = reversed;
+      reversed = list;
+      list = next;
+    }
+    return reversed;
+  }
+
+  bool empty() const noexcept
+  {
+    return head.load(std::memory_order_relaxed) == nullptr;
+  }
+
+private:
+  std::atomic<retired_object *> head{nullptr};
+};
+
+#endif /* RETIRED_OBJECT_H_ */
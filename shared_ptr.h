@@ -3,14 +3,17 @@
 
 #include "control_block.h"
 #include <memory>
+#include <memory_resource>
 
-template<typename T>
+template<typename T, class Policy = default_policy>
 struct weak_ptr;
 
-template<typename T>
+template<typename T, class Policy = default_policy>
 struct shared_ptr
 {
 public:
+  using element_type = std::remove_extent_t<T>;
+
   shared_ptr() noexcept = default;
 
   template<typename Y>
@@ -29,27 +32,35 @@ public:
   shared_ptr(const shared_ptr &other) noexcept;
 
   template<typename Y>
-  shared_ptr(const shared_ptr<Y> &other) noexcept;
+  shared_ptr(const shared_ptr<Y, Policy> &other) noexcept;
 
   shared_ptr(shared_ptr &&other) noexcept;
 
   template<typename Y>
-  shared_ptr(shared_ptr<Y> &&other) noexcept;
+  shared_ptr(shared_ptr<Y, Policy> &&other) noexcept;
+
+
+  // Conversion from another counting policy: the result gets its own block
+  // holding one reference of the source, released with the last of the new ones
+  template<typename Y, class OtherPolicy,
+           typename = std::enable_if_t<!std::is_same_v<OtherPolicy, Policy> &&
+                                       std::is_convertible_v<Y *, T *>>>
+  explicit shared_ptr(const shared_ptr<Y, OtherPolicy> &other);
 
 
   template<typename Y>
-  shared_ptr(const shared_ptr<Y> &other, T *ptr) noexcept;
+  shared_ptr(const shared_ptr<Y, Policy> &other, element_type *ptr) noexcept;
 
 
   shared_ptr & operator=(const shared_ptr &other) noexcept;
 
   template<typename Y>
-  shared_ptr & operator=(const shared_ptr<Y> &other) noexcept;
+  shared_ptr & operator=(const shared_ptr<Y, Policy> &other) noexcept;
 
   shared_ptr & operator=(shared_ptr &&other) noexcept;
 
   template<typename Y>
-  shared_ptr & operator=(shared_ptr<Y> &&other) noexcept;
+  shared_ptr & operator=(shared_ptr<Y, Policy> &&other) noexcept;
 
 
   ~shared_ptr();
@@ -64,72 +75,124 @@ public:
   void reset(Y *ptr, Deleter d);
 
 
-  T * get() const noexcept;
-  T & operator*() const noexcept;
-  T * operator->() const noexcept;
+  element_type * get() const noexcept;
+  element_type & operator*() const noexcept;
+  element_type * operator->() const noexcept;
+  // For arrays only
+  element_type & operator[](ptrdiff_t idx) const noexcept;
 
   explicit operator bool() const noexcept;
 
   size_t use_count() const noexcept;
 
+  // Block until this is the only reference left, or at most threshold
+  // are, without spinning on use_count. Policies that count waiters only,
+  // see counts_waiters. An atomic_shared_ptr holding the object keeps a
+  // reserve of references, so these wait for it to let go too
+  void wait_until_unique() const;
+  bool wait_for_release(size_t threshold,
+                        std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max()) const;
+
 private:
-  control_block *cblock = nullptr;
-  T *ptr = nullptr;
+  control_block<Policy> *cblock = nullptr;
+  element_type *ptr = nullptr;
+
+  // Arrays are released with delete[]
+  template<typename Y>
+  using default_deleter = std::conditional_t<std::is_array_v<T>, std::default_delete<element_type[]>, std::default_delete<Y>>;
 
   template<typename Y>
-  shared_ptr(control_block *cblock, Y *ptr) noexcept;
+  shared_ptr(control_block<Policy> *cblock, Y *ptr) noexcept;
+
+  template<typename Y, typename U, class P>
+  friend void swap(shared_ptr<Y, P> &left, shared_ptr<U, P> &right) noexcept;
+
+  template<typename Y, class P>
+  friend struct shared_ptr;
+
+  template<typename Y, class P>
+  friend struct weak_ptr;
+
+  template<typename Y, class P>
+  friend struct compact_shared_ptr;
+
+  template<typename Y, class P>
+  friend struct compact_weak_ptr;
+
+  template<typename Y, class P>
+  friend struct atomic_shared_ptr;
 
-  template<typename Y, typename U>
-  friend void swap(shared_ptr<Y> &left, shared_ptr<U> &right) noexcept;
+  template<typename Y, class P>
+  friend struct hazard_cell;
+
+  template<typename Y, class P>
+  friend struct hazard_ptr;
 
   template<typename Y>
-  friend class shared_ptr;
+  friend void kill_shards(const shared_ptr<Y, sharded_policy> &p) noexcept;
+
+  template<typename Y, class P, typename ...Args>
+  friend shared_ptr<Y, P> make_shared(Args&&... args);
 
-  friend class weak_ptr<T>;
+  template<typename Y, class P, typename ...Args>
+  friend shared_ptr<Y, P> make_shared_for_overwrite(Args&&... args);
 
-  template<typename Y, typename ...Args>
-  friend shared_ptr<Y> make_shared(Args&&... args);
+  template<typename Y, class P, class Alloc, typename ...Args>
+  friend shared_ptr<Y, P> allocate_shared(const Alloc &alloc, Args&&... args);
 };
 
-template<typename T, typename U>
-bool operator==(const shared_ptr<T> &left, const shared_ptr<U> &right)
+// Deleter of a block made by a policy conversion
+template<typename T, class Policy>
+struct policy_bridge_deleter
+{
+  shared_ptr<T, Policy> source;
+
+  template<typename Y>
+  void operator()(Y *) noexcept
+  {
+    source.reset();
+  }
+};
+
+template<typename T, typename U, class P1, class P2>
+bool operator==(const shared_ptr<T, P1> &left, const shared_ptr<U, P2> &right)
 {
   return left.get() == right.get();
 }
 
-template<typename T>
-bool operator==(const shared_ptr<T> &left, std::nullptr_t)
+template<typename T, class P>
+bool operator==(const shared_ptr<T, P> &left, std::nullptr_t)
 {
   return left.get() == nullptr;
 }
 
-template<typename T>
-bool operator==(std::nullptr_t, const shared_ptr<T> &right)
+template<typename T, class P>
+bool operator==(std::nullptr_t, const shared_ptr<T, P> &right)
 {
   return right.get() == nullptr;
 }
 
-template<typename T, typename U>
-bool operator!=(const shared_ptr<T> &left, const shared_ptr<U> &right)
+template<typename T, typename U, class P1, class P2>
+bool operator!=(const shared_ptr<T, P1> &left, const shared_ptr<U, P2> &right)
 {
   return !operator==(left, right);
 }
 
-template<typename T>
-bool operator!=(const shared_ptr<T> &left, std::nullptr_t)
+template<typename T, class P>
+bool operator!=(const shared_ptr<T, P> &left, std::nullptr_t)
 {
   return !operator==(left, nullptr);
 }
 
-template<typename T>
-bool operator!=(std::nullptr_t, const shared_ptr<T> &right)
+template<typename T, class P>
+bool operator!=(std::nullptr_t, const shared_ptr<T, P> &right)
 {
   return !operator==(nullptr, right);
 }
 
-template<typename T>
+template<typename T, class Policy>
 template<typename Y>
-shared_ptr<T>::shared_ptr(control_block *cblock, Y *ptr) noexcept : cblock(cblock), ptr(ptr)
+shared_ptr<T, Policy>::shared_ptr(control_block<Policy> *cblock, Y *ptr) noexcept : cblock(cblock), ptr(ptr)
 {
   if (cblock != nullptr)
   {
@@ -137,47 +200,59 @@ shared_ptr<T>::shared_ptr(control_block *cblock, Y *ptr) noexcept : cblock(cbloc
   }
 }
 
-template<typename T>
+template<typename T, class Policy>
 template<typename Y>
-shared_ptr<T>::shared_ptr(Y *ptr) : shared_ptr(ptr, std::default_delete<Y>())
+shared_ptr<T, Policy>::shared_ptr(Y *ptr) : shared_ptr(ptr, default_deleter<Y>())
 {
 }
 
-template<typename T>
-shared_ptr<T>::shared_ptr(std::nullptr_t) noexcept {}
+template<typename T, class Policy>
+shared_ptr<T, Policy>::shared_ptr(std::nullptr_t) noexcept {}
 
-template<typename T>
-shared_ptr<T>::shared_ptr(const shared_ptr &other) noexcept : shared_ptr(other.cblock, other.ptr)
+template<typename T, class Policy>
+shared_ptr<T, Policy>::shared_ptr(const shared_ptr &other) noexcept : shared_ptr(other.cblock, other.ptr)
 {
 }
 
-template<typename T>
+template<typename T, class Policy>
 template<typename Y>
-shared_ptr<T>::shared_ptr(const shared_ptr<Y> &other) noexcept : shared_ptr(other.cblock, other.ptr)
+shared_ptr<T, Policy>::shared_ptr(const shared_ptr<Y, Policy> &other) noexcept : shared_ptr(other.cblock, other.ptr)
 {
 }
 
-template<typename T>
-shared_ptr<T>::shared_ptr(shared_ptr &&other) noexcept : cblock(other.cblock), ptr(other.ptr)
+template<typename T, class Policy>
+shared_ptr<T, Policy>::shared_ptr(shared_ptr &&other) noexcept : cblock(other.cblock), ptr(other.ptr)
 {
   other.cblock = nullptr;
   other.ptr = nullptr;
 }
 
-template<typename T>
+template<typename T, class Policy>
 template<typename Y>
-shared_ptr<T>::shared_ptr(shared_ptr<Y> &&other) noexcept : cblock(other.cblock), ptr(other.ptr)
+shared_ptr<T, Policy>::shared_ptr(shared_ptr<Y, Policy> &&other) noexcept : cblock(other.cblock), ptr(other.ptr)
 {
   other.cblock = nullptr;
   other.ptr = nullptr;
 }
 
-template<typename T>
+template<typename T, class Policy>
+template<typename Y, class OtherPolicy, typename>
+shared_ptr<T, Policy>::shared_ptr(const shared_ptr<Y, OtherPolicy> &other)
+{
+  if (other.cblock != nullptr)
+  {
+    cblock = new regular_control_block<std::remove_extent_t<Y>, policy_bridge_deleter<Y, OtherPolicy>, Policy>(
+        other.ptr, policy_bridge_deleter<Y, OtherPolicy>{other});
+    ptr = other.ptr;
+  }
+}
+
+template<typename T, class Policy>
 template<typename Y, class Deleter>
-shared_ptr<T>::shared_ptr(Y *ptr, Deleter d) : ptr(ptr) {
+shared_ptr<T, Policy>::shared_ptr(Y *ptr, Deleter d) : ptr(ptr) {
   try
   {
-    cblock = new regular_control_block<Y, Deleter>(ptr, std::move(d));
+    cblock = new regular_control_block<Y, Deleter, Policy>(ptr, std::move(d));
   }
   catch (const std::exception &e)
   {
@@ -189,59 +264,59 @@ shared_ptr<T>::shared_ptr(Y *ptr, Deleter d) : ptr(ptr) {
   }
 }
 
-template<typename T>
+template<typename T, class Policy>
 template<class Deleter>
-shared_ptr<T>::shared_ptr(std::nullptr_t, Deleter d) :
-    shared_ptr(static_cast<T *>(nullptr), std::move(d)) {}
+shared_ptr<T, Policy>::shared_ptr(std::nullptr_t, Deleter d) :
+    shared_ptr(static_cast<element_type *>(nullptr), std::move(d)) {}
 
-template<typename T>
+template<typename T, class Policy>
 template<typename Y>
-shared_ptr<T>::shared_ptr(const shared_ptr<Y> &other, T *ptr) noexcept : shared_ptr(other.cblock, ptr)
+shared_ptr<T, Policy>::shared_ptr(const shared_ptr<Y, Policy> &other, element_type *ptr) noexcept : shared_ptr(other.cblock, ptr)
 {
 }
 
-template<typename T, typename Y>
-void swap(shared_ptr<T> &left, shared_ptr<Y> &right) noexcept
+template<typename T, typename Y, class Policy>
+void swap(shared_ptr<T, Policy> &left, shared_ptr<Y, Policy> &right) noexcept
 {
   std::swap(left.ptr, right.ptr);
   std::swap(left.cblock, right.cblock);
 }
 
-template<typename T>
-shared_ptr<T> & shared_ptr<T>::operator=(const shared_ptr<T> &other) noexcept
+template<typename T, class Policy>
+shared_ptr<T, Policy> & shared_ptr<T, Policy>::operator=(const shared_ptr &other) noexcept
 {
   return operator=<T>(other);
 }
-template<typename T>
-shared_ptr<T> & shared_ptr<T>::operator=(shared_ptr<T> &&other) noexcept
+template<typename T, class Policy>
+shared_ptr<T, Policy> & shared_ptr<T, Policy>::operator=(shared_ptr &&other) noexcept
 {
   return operator=<T>(std::move(other));
 }
 
-template<typename T>
+template<typename T, class Policy>
 template<typename Y>
-shared_ptr<T> & shared_ptr<T>::operator=(const shared_ptr<Y> &other) noexcept
+shared_ptr<T, Policy> & shared_ptr<T, Policy>::operator=(const shared_ptr<Y, Policy> &other) noexcept
 {
-  shared_ptr<T> copy(other);
+  shared_ptr<T, Policy> copy(other);
   swap(copy, *this);
   return *this;
 }
 
-template<typename T>
+template<typename T, class Policy>
 template<typename Y>
-shared_ptr<T> & shared_ptr<T>::operator=(shared_ptr<Y> &&other) noexcept
+shared_ptr<T, Policy> & shared_ptr<T, Policy>::operator=(shared_ptr<Y, Policy> &&other) noexcept
 {
   if (cblock != other.cblock)
   {
-    shared_ptr<T> empty;
+    shared_ptr<T, Policy> empty;
     swap(*this, empty);
     swap(other, *this);
   }
   return *this;
 }
 
-template<typename T>
-shared_ptr<T>::~shared_ptr()
+template<typename T, class Policy>
+shared_ptr<T, Policy>::~shared_ptr()
 {
   if (cblock != nullptr)
   {
@@ -249,67 +324,232 @@ shared_ptr<T>::~shared_ptr()
   }
 }
 
-template<typename T>
-void shared_ptr<T>::reset() noexcept
+template<typename T, class Policy>
+void shared_ptr<T, Policy>::reset() noexcept
 {
-  shared_ptr<T> empty;
+  shared_ptr<T, Policy> empty;
   swap(*this, empty);
 }
 
-template<typename T>
+template<typename T, class Policy>
 template<typename Y>
-void shared_ptr<T>::reset(Y *ptr)
+void shared_ptr<T, Policy>::reset(Y *ptr)
 {
-  shared_ptr<T> other(ptr);
+  shared_ptr<T, Policy> other(ptr);
   swap(*this, other);
 }
 
-template<typename T>
+template<typename T, class Policy>
 template<typename Y, class Deleter>
-void shared_ptr<T>::reset(Y *ptr, Deleter d)
+void shared_ptr<T, Policy>::reset(Y *ptr, Deleter d)
 {
-  shared_ptr<T> other(ptr, std::move(d));
+  shared_ptr<T, Policy> other(ptr, std::move(d));
   swap(*this, other);
 }
 
-template<typename T>
-T * shared_ptr<T>::get() const noexcept
+template<typename T, class Policy>
+typename shared_ptr<T, Policy>::element_type * shared_ptr<T, Policy>::get() const noexcept
 {
   return ptr;
 }
 
-template<typename T>
-T & shared_ptr<T>::operator*() const noexcept
+template<typename T, class Policy>
+typename shared_ptr<T, Policy>::element_type & shared_ptr<T, Policy>::operator*() const noexcept
 {
+  static_assert(!std::is_array_v<T>, "use operator[] for arrays");
   return *ptr;
 }
 
-template<typename T>
-T * shared_ptr<T>::operator->() const noexcept
+template<typename T, class Policy>
+typename shared_ptr<T, Policy>::element_type * shared_ptr<T, Policy>::operator->() const noexcept
 {
+  static_assert(!std::is_array_v<T>, "use operator[] for arrays");
   return ptr;
 }
 
-template<typename T>
-shared_ptr<T>::operator bool() const noexcept
+template<typename T, class Policy>
+typename shared_ptr<T, Policy>::element_type & shared_ptr<T, Policy>::operator[](ptrdiff_t idx) const noexcept
+{
+  static_assert(std::is_array_v<T>, "operator[] is only for arrays");
+  return ptr[idx];
+}
+
+template<typename T, class Policy>
+shared_ptr<T, Policy>::operator bool() const noexcept
 {
   return ptr;
 }
 
-template<typename T>
-size_t shared_ptr<T>::use_count() const noexcept
+template<typename T, class Policy>
+size_t shared_ptr<T, Policy>::use_count() const noexcept
 {
   return cblock ? cblock->ref_count() : 0;
 }
 
-template<typename T, typename ...Args>
-shared_ptr<T> make_shared(Args&&... args)
+template<typename T, class Policy>
+void shared_ptr<T, Policy>::wait_until_unique() const
+{
+  wait_for_release(1);
+}
+
+template<typename T, class Policy>
+bool shared_ptr<T, Policy>::wait_for_release(size_t threshold, std::chrono::nanoseconds timeout) const
+{
+  return cblock == nullptr || cblock->wait_for_release(threshold, timeout);
+}
+
+// Switches the block of p to one exact count early, see sharded_policy.
+// Meant for the owner that publishes the object, once it is unpublished,
+// so the releases after it do not wait for the shards to run out
+template<typename T>
+void kill_shards(const shared_ptr<T, sharded_policy> &p) noexcept
+{
+  if (p.cblock != nullptr)
+  {
+    p.cblock->collapse_counts();
+  }
+}
+
+// Objects at least this large are not placed in the control block by make_shared
+// if weak references are possible: a surviving weak_ptr would keep their memory
+inline constexpr size_t split_storage_threshold = 64 * 1024;
+
+// Like make_shared, but the object is allocated apart from the control block,
+// so its memory is freed as soon as the last shared reference is gone.
+// For arrays the only argument is the element count (unless the bound is known)
+template<typename T, class Policy = default_policy, typename ...Args>
+shared_ptr<T, Policy> make_shared_split(Args&&... args)
+{
+  if constexpr (std::is_array_v<T>)
+  {
+    static_assert(sizeof...(Args) == (std::extent_v<T> == 0),
+                  "only the element count of T[] can be given");
+    size_t count = std::extent_v<T>;
+    if constexpr (std::extent_v<T> == 0)
+      count = size_t(args...);
+    return shared_ptr<T, Policy>(new std::remove_extent_t<T>[count]());
+  }
+  else
+  {
+    return shared_ptr<T, Policy>(new T(std::forward<Args>(args)...));
+  }
+}
+
+// For arrays, the arguments are the element count (unless the bound is known)
+// and optionally a value to copy into each element.
+// Objects of split_storage_threshold bytes or more are made by make_shared_split
+template<typename T, class Policy = default_policy, typename ...Args>
+shared_ptr<T, Policy> make_shared(Args&&... args)
+{
+  shared_ptr<T, Policy> res;
+  if constexpr (std::is_array_v<T>)
+  {
+    using element = std::remove_extent_t<T>;
+    using block = inplace_array_control_block<element, Policy>;
+    block *cblock;
+    if constexpr (std::extent_v<T> == 0)
+    {
+      // Arrays with an initial value are always in place
+      if constexpr (Policy::has_weak && sizeof...(Args) == 1)
+        if (size_t(args...) >= split_storage_threshold / sizeof(element))
+          return make_shared_split<T, Policy>(std::forward<Args>(args)...);
+      cblock = block::create(std::forward<Args>(args)...);
+    }
+    else
+    {
+      if constexpr (Policy::has_weak && sizeof...(Args) == 0 && sizeof(T) >= split_storage_threshold)
+        return make_shared_split<T, Policy>();
+      cblock = block::create(std::extent_v<T>, std::forward<Args>(args)...);
+    }
+    res.cblock = cblock;
+    res.ptr = cblock->elements();
+  }
+  else if constexpr (Policy::has_weak && sizeof(T) >= split_storage_threshold)
+  {
+    return make_shared_split<T, Policy>(std::forward<Args>(args)...);
+  }
+  else
+  {
+    inplace_control_block<T, Policy> *cblock = new inplace_control_block<T, Policy>(std::forward<Args>(args)...);
+    res.cblock = cblock;
+    res.ptr = reinterpret_cast<T *>(&cblock->stg);
+  }
+  return res;
+}
+
+// Like make_shared, but default-initializes: trivial objects and elements
+// are left unwritten. For T[] the only argument is the element count.
+// Large objects are split from the block as by make_shared
+template<typename T, class Policy = default_policy, typename ...Args>
+shared_ptr<T, Policy> make_shared_for_overwrite(Args&&... args)
 {
-  inplace_control_block<T> *cblock = new inplace_control_block<T>(std::forward<Args>(args)...);
-  shared_ptr<T> res;
-  res.cblock = cblock;
-  res.ptr = reinterpret_cast<T *>(&cblock->stg);
+  static_assert(sizeof...(Args) == (std::is_array_v<T> && std::extent_v<T> == 0),
+                "only the element count of T[] can be given");
+  shared_ptr<T, Policy> res;
+  if constexpr (std::is_array_v<T>)
+  {
+    using element = std::remove_extent_t<T>;
+    using block = inplace_array_control_block<element, Policy>;
+    size_t count = std::extent_v<T>;
+    if constexpr (std::extent_v<T> == 0)
+      count = size_t(args...);
+    if (Policy::has_weak && count >= split_storage_threshold / sizeof(element))
+      return shared_ptr<T, Policy>(new element[count]);
+    block *cblock = block::create(count, default_init);
+    res.cblock = cblock;
+    res.ptr = cblock->elements();
+  }
+  else if constexpr (Policy::has_weak && sizeof(T) >= split_storage_threshold)
+  {
+    return shared_ptr<T, Policy>(new T);
+  }
+  else
+  {
+    inplace_control_block<T, Policy> *cblock = new inplace_control_block<T, Policy>(default_init);
+    res.cblock = cblock;
+    res.ptr = reinterpret_cast<T *>(&cblock->stg);
+  }
   return res;
 }
 
+template<typename T, class Policy = default_policy, typename ...Args>
+shared_ptr<T, Policy> allocate_shared(std::pmr::memory_resource *resource, Args&&... args);
+
+// The block stores a copy of alloc and is freed through it
+template<typename T, class Policy = default_policy, class Alloc, typename ...Args>
+shared_ptr<T, Policy> allocate_shared(const Alloc &alloc, Args&&... args)
+{
+  if constexpr (std::is_convertible_v<Alloc, std::pmr::memory_resource *>)
+  {
+    return allocate_shared<T, Policy>(static_cast<std::pmr::memory_resource *>(alloc),
+                                      std::forward<Args>(args)...);
+  }
+  else
+  {
+    using block = allocated_control_block<T, Alloc, Policy>;
+    using traits = std::allocator_traits<typename block::allocator_type>;
+    typename block::allocator_type block_alloc(alloc);
+    block *cblock = traits::allocate(block_alloc, 1);
+    try
+    {
+      ::new(static_cast<void *>(cblock)) block(block_alloc, std::forward<Args>(args)...);
+    }
+    catch (...)
+    {
+      traits::deallocate(block_alloc, cblock, 1);
+      throw;
+    }
+    shared_ptr<T, Policy> res;
+    res.cblock = cblock;
+    res.ptr = reinterpret_cast<T *>(&cblock->stg);
+    return res;
+  }
+}
+
+template<typename T, class Policy, typename ...Args>
+shared_ptr<T, Policy> allocate_shared(std::pmr::memory_resource *resource, Args&&... args)
+{
+  return allocate_shared<T, Policy>(std::pmr::polymorphic_allocator<T>(resource), std::forward<Args>(args)...);
+}
+
 #endif /* SHARED_PTR_H_ */
@@ -0,0 +1,223 @@
+#ifndef SNAPSHOT_CELL_H_
+#define SNAPSHOT_CELL_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <utility>
+#include "atomic_shared_ptr.h"
+
+template<typename T, class Policy>
+struct snapshot_guard;
+
+// Published value that many threads read and few replace, such as a
+// configuration. Each thread keeps a copy of the latest value it read in
+// a small per-thread cache, checked against the cell's version on every
+// read, so reads touch no counts unless the value changed. Publishing a
+// value or destroying a cell drops the publishing thread's stale copies
+// right away; every other thread drops its own on its next read of any
+// cell of the same type, or when it finishes. Threads may also sleep
+// until a new value is published
+template<typename T, class Policy = default_policy>
+struct snapshot_cell
+{
+  snapshot_cell() = default;
+  explicit snapshot_cell(shared_ptr<T, Policy> initial) : value(std::move(initial)) {}
+
+  snapshot_cell(const snapshot_cell &) = delete;
+  snapshot_cell & operator=(const snapshot_cell &) = delete;
+
+  ~snapshot_cell();
+
+  // Makes value the one new reads see
+  void publish(shared_ptr<T, Policy> value);
+
+  // Wait-free unless the value changed since the thread last read it.
+  // While a thread holds a guard on the cell, its other reads of the cell
+  // see the same value
+  snapshot_guard<T, Policy> read() const;
+
+  // Shares ownership of the latest value
+  shared_ptr<T, Policy> load() const noexcept
+  {
+    return value.load();
+  }
+
+  uint64_t version() const noexcept
+  {
+    return state->version.load(std::memory_order_acquire);
+  }
+
+  // Blocks until a value newer than version is published
+  void wait(uint64_t version) const
+  {
+    changes.wait([&] { return this->version() != version; });
+  }
+
+  // Returns false if the timeout passed first
+  bool wait_for(uint64_t version, std::chrono::nanoseconds timeout) const
+  {
+    return changes.wait_for([&] { return this->version() != version; }, timeout);
+  }
+
+private:
+  friend struct snapshot_guard<T, Policy>;
+
+  // Kept while cache entries refer to it, so a destroyed cell's entries
+  // can tell. The version is 0 once the cell is gone
+  struct cell_state
+  {
+    std::atomic<uint64_t> version{1};
+  };
+
+  struct entry
+  {
+    shared_ptr<cell_state> state;
+    uint64_t version = 0;
+    // Guards using the entry, which keep it from being replaced
+    size_t guards = 0;
+    shared_ptr<T, Policy> value;
+  };
+
+  static constexpr size_t cache_size = 16;
+
+  static inline std::atomic<uint64_t> next_id{1};
+  // Counts the publications and destructions of every cell of the type
+  static inline std::atomic<uint64_t> changes_made{0};
+  static inline thread_local entry cache[cache_size];
+  // changes_made when the thread last dropped its stale entries
+  static inline thread_local uint64_t changes_swept = 0;
+
+  const uint64_t id = next_id.fetch_add(1, std::memory_order_relaxed);
+  const shared_ptr<cell_state> state = make_shared<cell_state>();
+  atomic_shared_ptr<T, Policy> value;
+  wait_word changes;
+
+  // Drops the thread's entries that are out of date and not guarded
+  static void sweep() noexcept;
+};
+
+// Access to the value read from a snapshot_cell. Holds no reference of its
+// own unless the thread's cache entry for the cell was in use by a guard
+// on another cell
+template<typename T, class Policy = default_policy>
+struct snapshot_guard
+{
+  using element_type = std::remove_extent_t<T>;
+
+  snapshot_guard(const snapshot_guard &) = delete;
+  snapshot_guard & operator=(const snapshot_guard &) = delete;
+
+  ~snapshot_guard()
+  {
+    if (pinned != nullptr)
+      pinned->guards--;
+  }
+
+  element_type * get() const noexcept
+  {
+    return ptr;
+  }
+
+  element_type & operator*() const noexcept
+  {
+    return *ptr;
+  }
+
+  element_type * operator->() const noexcept
+  {
+    return ptr;
+  }
+
+  explicit operator bool() const noexcept
+  {
+    return ptr != nullptr;
+  }
+
+  uint64_t version() const noexcept
+  {
+    return read_version;
+  }
+
+private:
+  friend struct snapshot_cell<T, Policy>;
+
+  using entry = typename snapshot_cell<T, Policy>::entry;
+
+  explicit snapshot_guard(entry &e) noexcept : pinned(&e), ptr(e.value.get()), read_version(e.version)
+  {
+    e.guards++;
+  }
+
+  snapshot_guard(shared_ptr<T, Policy> value, uint64_t version) noexcept :
+      owned(std::move(value)), ptr(owned.get()), read_version(version)
+  {
+  }
+
+  entry *pinned = nullptr;
+  shared_ptr<T, Policy> owned;
+  element_type *ptr;
+  uint64_t read_version;
+};
+
+template<typename T, class Policy>
+snapshot_cell<T, Policy>::~snapshot_cell()
+{
+  state->version.store(0, std::memory_order_release);
+  changes_made.fetch_add(1, std::memory_order_release);
+  sweep();
+}
+
+template<typename T, class Policy>
+void snapshot_cell<T, Policy>::publish(shared_ptr<T, Policy> desired)
+{
+  value.store(std::move(desired));
+  // A reader that sees the new version then loads the new value
+  state->version.fetch_add(1, std::memory_order_release);
+  changes_made.fetch_add(1, std::memory_order_release);
+  changes.notify_all();
+  sweep();
+}
+
+template<typename T, class Policy>
+void snapshot_cell<T, Policy>::sweep() noexcept
+{
+  changes_swept = changes_made.load(std::memory_order_acquire);
+  for (entry &e : cache)
+  {
+    if (e.state != nullptr && e.guards == 0 && e.version != e.state->version.load(std::memory_order_acquire))
+    {
+      // Released after the entry is cleared, as the destructors may read cells
+      shared_ptr<T, Policy> old = std::move(e.value);
+      shared_ptr<cell_state> old_state = std::move(e.state);
+      e.version = 0;
+    }
+  }
+}
+
+template<typename T, class Policy>
+snapshot_guard<T, Policy> snapshot_cell<T, Policy>::read() const
+{
+  if (changes_swept != changes_made.load(std::memory_order_relaxed))
+    sweep();
+  entry &e = cache[id % cache_size];
+  if (e.state == state)
+  {
+    if (e.guards != 0 || e.version == state->version.load(std::memory_order_acquire))
+      return snapshot_guard<T, Policy>(e);
+  }
+  else if (e.guards != 0)
+  {
+    uint64_t v = state->version.load(std::memory_order_acquire);
+    return snapshot_guard<T, Policy>(value.load(), v);
+  }
+  // The version is read first, so the value is at least that recent
+  uint64_t v = state->version.load(std::memory_order_acquire);
+  // Released after the entry is set, as their destructors may read cells
+  shared_ptr<T, Policy> old = std::exchange(e.value, value.load());
+  shared_ptr<cell_state> old_state = std::exchange(e.state, state);
+  e.version = v;
+  return snapshot_guard<T, Policy>(e);
+}
+
+#endif /* SNAPSHOT_CELL_H_ */
@@ -4,46 +4,54 @@
 #include <memory>
 #include "shared_ptr.h"
 
-template<typename T>
+template<typename T, class Policy>
 struct weak_ptr
 {
+  static_assert(Policy::has_weak, "the counting policy does not support weak references");
+
 public:
   weak_ptr() noexcept = default;
 
   template<typename Y>
-  weak_ptr(const shared_ptr<Y> &other) noexcept;
+  weak_ptr(const shared_ptr<Y, Policy> &other) noexcept;
 
   weak_ptr(const weak_ptr &other) noexcept;
   template<typename Y>
-  weak_ptr(const weak_ptr<Y> &other) noexcept;
+  weak_ptr(const weak_ptr<Y, Policy> &other) noexcept;
   weak_ptr(weak_ptr &&other) noexcept;
   template<typename Y>
-  weak_ptr(weak_ptr<Y> &&other) noexcept;
+  weak_ptr(weak_ptr<Y, Policy> &&other) noexcept;
 
   weak_ptr & operator=(const weak_ptr &other) noexcept;
   template<typename Y>
-  weak_ptr & operator=(const weak_ptr<Y> &other) noexcept;
+  weak_ptr & operator=(const weak_ptr<Y, Policy> &other) noexcept;
   weak_ptr & operator=(weak_ptr &&other) noexcept;
   template<typename Y>
-  weak_ptr & operator=(weak_ptr<Y> &&other) noexcept;
+  weak_ptr & operator=(weak_ptr<Y, Policy> &&other) noexcept;
 
   ~weak_ptr();
 
   void reset() noexcept;
 
-  shared_ptr<T> lock() const noexcept;
+  shared_ptr<T, Policy> lock() const noexcept;
 private:
-  control_block *cblock = nullptr;
-  T *ptr = nullptr;
+  control_block<Policy> *cblock = nullptr;
+  std::remove_extent_t<T> *ptr = nullptr;
+
+  weak_ptr(control_block<Policy> *cblock, std::remove_extent_t<T> *ptr) noexcept;
+
+  template<typename Y, typename U, class P>
+  friend void swap(weak_ptr<Y, P> &left, weak_ptr<U, P> &right) noexcept;
 
-  weak_ptr(control_block *cblock, T *ptr) noexcept;
+  template<typename Y, class P>
+  friend struct weak_ptr;
 
-  template<typename Y, typename U>
-  friend void swap(weak_ptr<Y> &left, weak_ptr<U> &right) noexcept;
+  template<typename Y, class P>
+  friend struct atomic_weak_ptr;
 };
 
-template<typename T>
-weak_ptr<T>::weak_ptr(control_block *cblock, T *ptr) noexcept : cblock(cblock), ptr(ptr)
+template<typename T, class Policy>
+weak_ptr<T, Policy>::weak_ptr(control_block<Policy> *cblock, std::remove_extent_t<T> *ptr) noexcept : cblock(cblock), ptr(ptr)
 {
   if (cblock != nullptr)
   {
@@ -51,82 +59,82 @@ weak_ptr<T>::weak_ptr(control_block *cblock, T *ptr) noexcept : cblock(cblock),
   }
 }
 
-template<typename T>
+template<typename T, class Policy>
 template<typename Y>
-weak_ptr<T>::weak_ptr(const shared_ptr<Y> &other) noexcept : weak_ptr(other.cblock, other.ptr)
+weak_ptr<T, Policy>::weak_ptr(const shared_ptr<Y, Policy> &other) noexcept : weak_ptr(other.cblock, other.ptr)
 {
 }
 
-template<typename T>
-weak_ptr<T>::weak_ptr(const weak_ptr &other) noexcept : weak_ptr(other.cblock, other.ptr)
+template<typename T, class Policy>
+weak_ptr<T, Policy>::weak_ptr(const weak_ptr &other) noexcept : weak_ptr(other.cblock, other.ptr)
 {
 }
 
-template<typename T>
+template<typename T, class Policy>
 template<typename Y>
-weak_ptr<T>::weak_ptr(const weak_ptr<Y> &other) noexcept : weak_ptr(other.cblock, other.ptr)
+weak_ptr<T, Policy>::weak_ptr(const weak_ptr<Y, Policy> &other) noexcept : weak_ptr(other.cblock, other.ptr)
 {
 }
 
-template<typename T>
-weak_ptr<T>::weak_ptr(weak_ptr &&other) noexcept : cblock(other.cblock), ptr(other.ptr)
+template<typename T, class Policy>
+weak_ptr<T, Policy>::weak_ptr(weak_ptr &&other) noexcept : cblock(other.cblock), ptr(other.ptr)
 {
   other.cblock = nullptr;
   other.ptr = nullptr;
 }
 
-template<typename T>
+template<typename T, class Policy>
 template<typename Y>
-weak_ptr<T>::weak_ptr(weak_ptr<Y> &&other) noexcept : cblock(other.cblock), ptr(other.ptr)
+weak_ptr<T, Policy>::weak_ptr(weak_ptr<Y, Policy> &&other) noexcept : cblock(other.cblock), ptr(other.ptr)
 {
   other.cblock = nullptr;
   other.ptr = nullptr;
 }
 
-template<typename T>
-weak_ptr<T> & weak_ptr<T>::operator=(const weak_ptr &other) noexcept
+template<typename T, class Policy>
+weak_ptr<T, Policy> & weak_ptr<T, Policy>::operator=(const weak_ptr &other) noexcept
 {
   return operator=<T>(other);
 }
 
-template<typename T, typename Y>
-void swap(weak_ptr<T> &left, weak_ptr<Y> &right) noexcept
+template<typename T, typename Y, class Policy>
+void swap(weak_ptr<T, Policy> &left, weak_ptr<Y, Policy> &right) noexcept
 {
   std::swap(left.cblock, right.cblock);
   std::swap(left.ptr, right.ptr);
 }
 
 
-template<typename T>
+template<typename T, class Policy>
 template<typename Y>
-weak_ptr<T> & weak_ptr<T>::operator=(const weak_ptr<Y> &other) noexcept
+weak_ptr<T, Policy> & weak_ptr<T, Policy>::operator=(const weak_ptr<Y, Policy> &other) noexcept
 {
-  weak_ptr<T> copy(other);
+  weak_ptr<T, Policy> copy(other);
   swap(*this, copy);
   return *this;
 }
 
-template<typename T>
-weak_ptr<T> & weak_ptr<T>::operator=(weak_ptr &&other) noexcept
+template<typename T, class Policy>
+weak_ptr<T, Policy> & weak_ptr<T, Policy>::operator=(weak_ptr &&other) noexcept
 {
   return operator=<T>(std::move(other));
 }
 
-template<typename T>
+template<typename T, class Policy>
 template<typename Y>
-weak_ptr<T> & weak_ptr<T>::operator=(weak_ptr<Y> &&other) noexcept
+weak_ptr<T, Policy> & weak_ptr<T, Policy>::operator=(weak_ptr<Y, Policy> &&other) noexcept
 {
   if (&other != this)
   {
-    weak_ptr<T> empty;
+    weak_ptr<T, Policy> empty;
     swap(*this, empty);
     swap(other, *this);
   }
   return *this;
 }
 
-template<typename T>
-weak_ptr<T>::~weak_ptr()
+template<typename T, class Policy>
+weak_ptr<T, Policy>::~weak_ptr()
 {
   if (cblock != nullptr)
   {
@@ -134,20 +142,23 @@ weak_ptr<T>::~weak_ptr()
   }
 }
 
-template<typename T>
-void weak_ptr<T>::reset() noexcept
+template<typename T, class Policy>
+void weak_ptr<T, Policy>::reset() noexcept
 {
-  weak_ptr<T> empty;
+  weak_ptr<T, Policy> empty;
   swap(*this, empty);
-  return *this;
 }
 
-template<typename T>
-shared_ptr<T> weak_ptr<T>::lock() const noexcept
+template<typename T, class Policy>
+shared_ptr<T, Policy> weak_ptr<T, Policy>::lock() const noexcept
 {
-  if (cblock == nullptr || cblock->ref_count() == 0)
-    return shared_ptr<T>();
-  return shared_ptr<T>(cblock, ptr);
+  shared_ptr<T, Policy> res;
+  if (cblock != nullptr && cblock->try_add_ref())
+  {
+    res.cblock = cblock;
+    res.ptr = ptr;
+  }
+  return res;
 }
 
 #endif /* WEAK_PTR_H_ */